@@ -0,0 +1,72 @@
+#include "arena.h"
+#include <stdlib.h>
+
+// size of the first block
+#define ARENA_MIN_BLOCK_SIZE (64 * 1024)
+#define ARENA_ALIGNMENT 16
+
+static void push_block(arena_t *arena, size_t capacity) {
+  arena_block_t *block = (arena_block_t *)malloc(sizeof(arena_block_t));
+  // malloc memory is aligned for any type, which on x86-64 is 16 bytes
+  block->memory = (char *)malloc(capacity);
+  block->capacity = capacity;
+  block->used = 0;
+  block->next = arena->blocks;
+  arena->blocks = block;
+}
+
+static void free_blocks(arena_t *arena) {
+  arena_block_t *block = arena->blocks;
+  while (block != NULL) {
+    arena_block_t *next = block->next;
+    free(block->memory);
+    free(block);
+    block = next;
+  }
+  arena->blocks = NULL;
+}
+
+void *arena_alloc(arena_t *arena, size_t size) {
+  size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+
+  arena_block_t *block = arena->blocks;
+  if (block == NULL || block->used + size > block->capacity) {
+    // Chain a new block instead of growing this one, so the memory handed out
+    // so far stays where it is
+    size_t capacity =
+        block != NULL ? block->capacity * 2 : ARENA_MIN_BLOCK_SIZE;
+    if (capacity < size) {
+      capacity = size;
+    }
+    push_block(arena, capacity);
+    block = arena->blocks;
+  }
+
+  void *result = block->memory + block->used;
+  block->used += size;
+  arena->used += size;
+  if (arena->used > arena->peak) {
+    arena->peak = arena->used;
+  }
+  return result;
+}
+
+void arena_reset(arena_t *arena) {
+  // More than one block means the last frames needed more than the newest
+  // block holds: replace them all with one block big enough for the peak
+  if (arena->blocks != NULL && arena->blocks->next != NULL) {
+    free_blocks(arena);
+    push_block(arena, arena->peak);
+  }
+  if (arena->blocks != NULL) {
+    arena->blocks->used = 0;
+  }
+  arena->used = 0;
+}
+
+size_t arena_peak(arena_t *arena) { return arena->peak; }
+
+void arena_free(arena_t *arena) {
+  free_blocks(arena);
+  arena->used = 0;
+}
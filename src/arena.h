@@ -0,0 +1,32 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+// A frame arena hands out memory by bumping a pointer and takes it all back
+// at once with arena_reset(). While warming up it chains extra blocks when it
+// runs out, and on the next reset merges them into one block as big as the
+// largest frame so far, so a steady scene makes no malloc/free calls at all
+typedef struct arena_block {
+  struct arena_block *next; // older, fuller block
+  char *memory;
+  size_t capacity;
+  size_t used;
+} arena_block_t;
+
+typedef struct {
+  arena_block_t *blocks; // newest block first
+  size_t used;           // bytes handed out since the last reset
+  size_t peak;           // most bytes handed out between two resets
+} arena_t;
+
+/**
+ * Return size bytes (16 byte aligned, so SIMD loads are fine) that stay
+ * valid until the next arena_reset()
+ */
+void *arena_alloc(arena_t *arena, size_t size);
+void arena_reset(arena_t *arena);
+size_t arena_peak(arena_t *arena);
+void arena_free(arena_t *arena);
+
+#endif
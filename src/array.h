@@ -9,6 +9,8 @@
 
 void *array_hold(void *array, int count, int item_size);
 int array_length(void *array);
+// empty the array but keep its memory so it can be refilled without allocating
+void array_clear(void *array);
 void array_free(void *array);
 
 #endif
@@ -4,63 +4,100 @@
 #define NUM_PLANES 6
 plane_t frustum_planes[NUM_PLANES];
 
+// how far past the screen edges (in multiples of the half screen size)
+// triangles can reach before they get clipped on x and y
+static float guard_band = DEFAULT_GUARD_BAND;
+static float guard_band_x = DEFAULT_GUARD_BAND;
+static float guard_band_y = DEFAULT_GUARD_BAND;
+
+// The guard band actually used on one axis: screen coordinates of clipped
+// triangles reach (guard band + 1) half screens from the screen origin, which
+// must stay within the range the rasterizer handles. The wider the window, the
+// smaller the band (before the window exists the size is unknown, and the
+// limit gets applied once init_frustum_planes runs)
+static float limit_guard_band(int screen_size) {
+  if (screen_size <= 0) {
+    return guard_band;
+  }
+  float limit = (float)MAX_SCREEN_COORD / (screen_size / 2.0) - 1;
+  return guard_band < limit ? guard_band : limit;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
-// Frustum planes are defined by a point and a normal vector
-///////////////////////////////////////////////////////////////////////////////
-// Near plane   :  P=(0, 0, znear), N=(0, 0,  1)
-// Far plane    :  P=(0, 0, zfar),  N=(0, 0, -1)
-// Top plane    :  P=(0, 0, 0),     N=(0, -cos(fov/2), sin(fov/2))
-// Bottom plane :  P=(0, 0, 0),     N=(0, cos(fov/2), sin(fov/2))
-// Left plane   :  P=(0, 0, 0),     N=(cos(fov/2), 0, sin(fov/2))
-// Right plane  :  P=(0, 0, 0),     N=(-cos(fov/2), 0, sin(fov/2))
-///////////////////////////////////////////////////////////////////////////////
+// Clipping happens in homogeneous clip space, after the projection matrix and
+// before the perspective divide. A clip space point (x, y, z, w) is inside the
+// view frustum when
+//
+//   -w < x < w,   -w < y < w,   0 < z < w
 //
-//           /|\
-//         /  | |
-//       /\   | |
-//     /      | |
-//  P*|-->  <-|*|   ----> +z-axis
-//     \      | |
-//       \/   | |
-//         \  | |
-//           \|/
+// The rasterizer scissors to the screen on its own, so triangles are only
+// clipped against the near and far planes, and against the guard band planes
+// (x and y within +-guard_band * w) when they reach that far out. This keeps
+// triangles crossing the screen edges whole instead of splitting them up.
 //
+// The camera space frustum planes (used to cull whole meshes by their bounding
+// spheres) are extracted from the rows of the projection matrix: the clip
+// space test x + w > 0 is (row0 + row3) . v > 0 for the camera space point v
 ///////////////////////////////////////////////////////////////////////////////
-void init_frustum_planes(float fov_x, float fov_y, float z_near, float z_far) {
-  float cos_half_fov_x = cos(fov_x / 2);
-  float sin_half_fov_x = sin(fov_x / 2);
-  float cos_half_fov_y = cos(fov_y / 2);
-  float sin_half_fov_y = sin(fov_y / 2);
-
-  frustum_planes[LEFT_FRUSTUM_PLANE].point = vec3_new(0, 0, 0);
-  frustum_planes[LEFT_FRUSTUM_PLANE].normal.x = cos_half_fov_x;
-  frustum_planes[LEFT_FRUSTUM_PLANE].normal.y = 0;
-  frustum_planes[LEFT_FRUSTUM_PLANE].normal.z = sin_half_fov_x;
-
-  frustum_planes[RIGHT_FRUSTUM_PLANE].point = vec3_new(0, 0, 0);
-  frustum_planes[RIGHT_FRUSTUM_PLANE].normal.x = -cos_half_fov_x;
-  frustum_planes[RIGHT_FRUSTUM_PLANE].normal.y = 0;
-  frustum_planes[RIGHT_FRUSTUM_PLANE].normal.z = sin_half_fov_x;
-
-  frustum_planes[TOP_FRUSTUM_PLANE].point = vec3_new(0, 0, 0);
-  frustum_planes[TOP_FRUSTUM_PLANE].normal.x = 0;
-  frustum_planes[TOP_FRUSTUM_PLANE].normal.y = -cos_half_fov_y;
-  frustum_planes[TOP_FRUSTUM_PLANE].normal.z = sin_half_fov_y;
-
-  frustum_planes[BOTTOM_FRUSTUM_PLANE].point = vec3_new(0, 0, 0);
-  frustum_planes[BOTTOM_FRUSTUM_PLANE].normal.x = 0;
-  frustum_planes[BOTTOM_FRUSTUM_PLANE].normal.y = cos_half_fov_y;
-  frustum_planes[BOTTOM_FRUSTUM_PLANE].normal.z = sin_half_fov_y;
-
-  frustum_planes[NEAR_FRUSTUM_PLANE].point = vec3_new(0, 0, z_near);
-  frustum_planes[NEAR_FRUSTUM_PLANE].normal.x = 0;
-  frustum_planes[NEAR_FRUSTUM_PLANE].normal.y = 0;
-  frustum_planes[NEAR_FRUSTUM_PLANE].normal.z = 1;
-
-  frustum_planes[FAR_FRUSTUM_PLANE].point = vec3_new(0, 0, z_far);
-  frustum_planes[FAR_FRUSTUM_PLANE].normal.x = 0;
-  frustum_planes[FAR_FRUSTUM_PLANE].normal.y = 0;
-  frustum_planes[FAR_FRUSTUM_PLANE].normal.z = -1;
+void init_frustum_planes(mat4_t proj_matrix) {
+  float(*m)[4] = proj_matrix.m;
+  float planes[NUM_PLANES][4];
+  for (int i = 0; i < 4; i++) {
+    planes[LEFT_FRUSTUM_PLANE][i] = m[3][i] + m[0][i];
+    planes[RIGHT_FRUSTUM_PLANE][i] = m[3][i] - m[0][i];
+    planes[TOP_FRUSTUM_PLANE][i] = m[3][i] - m[1][i];
+    planes[BOTTOM_FRUSTUM_PLANE][i] = m[3][i] + m[1][i];
+    planes[NEAR_FRUSTUM_PLANE][i] = m[2][i];
+    planes[FAR_FRUSTUM_PLANE][i] = m[3][i] - m[2][i];
+  }
+
+  // Turn each plane equation a*x + b*y + c*z + d into a unit normal and a
+  // point on the plane
+  for (int p = 0; p < NUM_PLANES; p++) {
+    vec3_t normal = vec3_new(planes[p][0], planes[p][1], planes[p][2]);
+    float length = vec3_length(normal);
+    frustum_planes[p].normal = vec3_div(normal, length);
+    frustum_planes[p].point =
+        vec3_mul(frustum_planes[p].normal, -planes[p][3] / length);
+  }
+
+  // the guard band limits depend on the screen size
+  guard_band_x = limit_guard_band(get_window_width());
+  guard_band_y = limit_guard_band(get_window_height());
+}
+
+void set_guard_band(float new_guard_band) {
+  // the guard band can not be smaller than the screen itself
+  guard_band = new_guard_band < 1 ? 1 : new_guard_band;
+  guard_band_x = limit_guard_band(get_window_width());
+  guard_band_y = limit_guard_band(get_window_height());
+}
+
+// Distance (scaled by w) of a clip space point from a clip plane, positive on
+// the inside
+static float clip_distance(vec4_t point, int plane) {
+  switch (plane) {
+  case LEFT_FRUSTUM_PLANE:
+    return point.w + point.x;
+  case RIGHT_FRUSTUM_PLANE:
+    return point.w - point.x;
+  case TOP_FRUSTUM_PLANE:
+    return point.w - point.y;
+  case BOTTOM_FRUSTUM_PLANE:
+    return point.w + point.y;
+  case NEAR_FRUSTUM_PLANE:
+    return point.z;
+  case FAR_FRUSTUM_PLANE:
+    return point.w - point.z;
+  case LEFT_GUARD_BAND_PLANE:
+    return guard_band_x * point.w + point.x;
+  case RIGHT_GUARD_BAND_PLANE:
+    return guard_band_x * point.w - point.x;
+  case TOP_GUARD_BAND_PLANE:
+    return guard_band_y * point.w - point.y;
+  default: // BOTTOM_GUARD_BAND_PLANE
+    return guard_band_y * point.w + point.y;
+  }
 }
 
 void triangles_from_polygon(polygon_t *polygon, triangle_t triangles[],
@@ -70,9 +107,9 @@ void triangles_from_polygon(polygon_t *polygon, triangle_t triangles[],
     int idx1 = i + 1;
     int idx2 = i + 2;
 
-    triangles[i].points[0] = vec4_from_vec3(polygon->vertices[idx0]);
-    triangles[i].points[1] = vec4_from_vec3(polygon->vertices[idx1]);
-    triangles[i].points[2] = vec4_from_vec3(polygon->vertices[idx2]);
+    triangles[i].points[0] = polygon->vertices[idx0];
+    triangles[i].points[1] = polygon->vertices[idx1];
+    triangles[i].points[2] = polygon->vertices[idx2];
 
     triangles[i].texcoords[0] = polygon->texcoords[idx0];
     triangles[i].texcoords[1] = polygon->texcoords[idx1];
@@ -81,7 +118,7 @@ void triangles_from_polygon(polygon_t *polygon, triangle_t triangles[],
   *num_triangles = polygon->num_vertices - 2;
 }
 
-polygon_t create_polygon_from_triangle(vec3_t v0, vec3_t v1, vec3_t v2,
+polygon_t create_polygon_from_triangle(vec4_t v0, vec4_t v1, vec4_t v2,
                                        tex2_t t0, tex2_t t1, tex2_t t2) {
   polygon_t polygon = {
       .vertices = {v0, v1, v2}, .texcoords = {t0, t1, t2}, .num_vertices = 3};
@@ -91,45 +128,42 @@ polygon_t create_polygon_from_triangle(vec3_t v0, vec3_t v1, vec3_t v2,
 float float_lerp(float a, float b, float t) { return a + t * (b - a); }
 
 void clip_polygon_against_plane(polygon_t *polygon, int plane) {
-  vec3_t plane_point = frustum_planes[plane].point;
-  vec3_t plane_normal = frustum_planes[plane].normal;
-
   // Declare a static array of inside vertices that will be part of the final
   // polygon returned via parameter
-  vec3_t inside_vertices[MAX_POLY_VERTICES];
+  vec4_t inside_vertices[MAX_POLY_VERTICES];
   tex2_t inside_texcoords[MAX_POLY_VERTICES];
   int num_inside_vertices = 0;
 
   // Start the current vertex with the first polygon vertex and texture
   // coordinate
-  vec3_t *current_vertex = &polygon->vertices[0];
+  vec4_t *current_vertex = &polygon->vertices[0];
   tex2_t *current_texcoord = &polygon->texcoords[0];
 
   // Start previous vertex with last polgyon vertex and texture coordinate
-  vec3_t *previous_vertex = &polygon->vertices[polygon->num_vertices - 1];
+  vec4_t *previous_vertex = &polygon->vertices[polygon->num_vertices - 1];
   tex2_t *previous_texcoord = &polygon->texcoords[polygon->num_vertices - 1];
 
-  // Calculate the dot product of the current and previous vertex
+  // Calculate the distance of the current and previous vertex to the plane
   float current_dot = 0;
-  float previous_dot =
-      vec3_dot(vec3_sub(*previous_vertex, plane_point), plane_normal);
+  float previous_dot = clip_distance(*previous_vertex, plane);
 
   // Loop all the polygon vertices while the current is different than the last
   // one
   while (current_vertex != &polygon->vertices[polygon->num_vertices]) {
-    current_dot =
-        vec3_dot(vec3_sub(*current_vertex, plane_point), plane_normal);
+    current_dot = clip_distance(*current_vertex, plane);
 
     // If we changed from inside to outside or from outside to inside
     if (current_dot * previous_dot < 0) {
       // Use the lerp (linear interpolation) formula to Find the interpolation
-      // factor t
+      // factor t. Clip space is still linear (before the divide by w), so
+      // the texture coordinates can be lerped with the same t
       float t = previous_dot / (previous_dot - current_dot);
       // Calculate the intersection point I = Q1 + t(Q2-Q1)
-      vec3_t intersection_point = {
+      vec4_t intersection_point = {
           .x = float_lerp(previous_vertex->x, current_vertex->x, t),
           .y = float_lerp(previous_vertex->y, current_vertex->y, t),
-          .z = float_lerp(previous_vertex->z, current_vertex->z, t)};
+          .z = float_lerp(previous_vertex->z, current_vertex->z, t),
+          .w = float_lerp(previous_vertex->w, current_vertex->w, t)};
 
       // get interpolated U and V texture coordinates
       tex2_t interpolated_texcoord = {
@@ -137,7 +171,7 @@ void clip_polygon_against_plane(polygon_t *polygon, int plane) {
           .v = float_lerp(previous_texcoord->v, current_texcoord->v, t)};
 
       // Insert the intersection point to the list of "inside vertices"
-      inside_vertices[num_inside_vertices] = vec3_clone(&intersection_point);
+      inside_vertices[num_inside_vertices] = intersection_point;
       inside_texcoords[num_inside_vertices] =
           tex2_clone(&interpolated_texcoord);
       num_inside_vertices++;
@@ -146,7 +180,7 @@ void clip_polygon_against_plane(polygon_t *polygon, int plane) {
     // Current vertex is inside the plane
     if (current_dot > 0) {
       // Insert the current vertex to the list of "inside vertices"
-      inside_vertices[num_inside_vertices] = vec3_clone(current_vertex);
+      inside_vertices[num_inside_vertices] = *current_vertex;
       inside_texcoords[num_inside_vertices] = tex2_clone(current_texcoord);
       num_inside_vertices++;
     }
@@ -162,17 +196,70 @@ void clip_polygon_against_plane(polygon_t *polygon, int plane) {
   // At the end, copy the list of inside vertices into the destination polygon
   // (out parameter)
   for (int i = 0; i < num_inside_vertices; i++) {
-    polygon->vertices[i] = vec3_clone(&inside_vertices[i]);
+    polygon->vertices[i] = inside_vertices[i];
     polygon->texcoords[i] = tex2_clone(&inside_texcoords[i]);
   }
   polygon->num_vertices = num_inside_vertices;
 }
 
-void clip_polygon(polygon_t *polygon) {
-  clip_polygon_against_plane(polygon, LEFT_FRUSTUM_PLANE);
-  clip_polygon_against_plane(polygon, RIGHT_FRUSTUM_PLANE);
-  clip_polygon_against_plane(polygon, TOP_FRUSTUM_PLANE);
-  clip_polygon_against_plane(polygon, BOTTOM_FRUSTUM_PLANE);
-  clip_polygon_against_plane(polygon, NEAR_FRUSTUM_PLANE);
-  clip_polygon_against_plane(polygon, FAR_FRUSTUM_PLANE);
+int compute_outcode(vec4_t point) {
+  int outcode = 0;
+  for (int plane = 0; plane < NUM_CLIP_PLANES; plane++) {
+    // same test clip_polygon_against_plane uses to keep a vertex
+    if (!(clip_distance(point, plane) > 0)) {
+      outcode |= 1 << plane;
+    }
+  }
+  return outcode;
+}
+
+int classify_sphere_in_frustum(vec3_t center, float radius) {
+  int result = FRUSTUM_INSIDE;
+  for (int plane = 0; plane < NUM_PLANES; plane++) {
+    float distance =
+        vec3_dot(vec3_sub(center, frustum_planes[plane].point),
+                 frustum_planes[plane].normal);
+    // entirely behind one plane: nothing of it can be visible
+    if (distance < -radius) {
+      return FRUSTUM_OUTSIDE;
+    }
+    // vertices only count as inside the clipper when strictly in front of
+    // every plane, so touching a plane is intersecting it
+    if (distance <= radius) {
+      result = FRUSTUM_INTERSECTING;
+    }
+  }
+  return result;
+}
+
+int classify_points_in_frustum(vec4_t points[], int num_points) {
+  int result = FRUSTUM_INSIDE;
+  for (int plane = 0; plane < NUM_PLANES; plane++) {
+    int num_inside = 0;
+    for (int i = 0; i < num_points; i++) {
+      if (clip_distance(points[i], plane) > 0) {
+        num_inside++;
+      }
+    }
+    if (num_inside == 0) {
+      return FRUSTUM_OUTSIDE;
+    }
+    if (num_inside < num_points) {
+      result = FRUSTUM_INTERSECTING;
+    }
+  }
+  return result;
+}
+
+void clip_polygon(polygon_t *polygon, int outcodes) {
+  // near and far first: they also get rid of the w <= 0 part behind the
+  // camera before the guard band planes (which scale with w) are used
+  static const int planes[] = {NEAR_FRUSTUM_PLANE,     FAR_FRUSTUM_PLANE,
+                               LEFT_GUARD_BAND_PLANE,  RIGHT_GUARD_BAND_PLANE,
+                               TOP_GUARD_BAND_PLANE,   BOTTOM_GUARD_BAND_PLANE};
+  for (int i = 0; i < 6; i++) {
+    if (outcodes & (1 << planes[i])) {
+      clip_polygon_against_plane(polygon, planes[i]);
+    }
+  }
 }
@@ -1,36 +1,72 @@
 #ifndef CLIPPING_H
 #define CLIPPING_H
 
+#include "matrix.h"
 #include "triangle.h"
 #include "vector.h"
 
 #define MAX_POLY_VERTICES 10
 #define MAX_POLY_TRIANGLES 10
 
+#define DEFAULT_GUARD_BAND 2.0
+
 enum {
   LEFT_FRUSTUM_PLANE,
   RIGHT_FRUSTUM_PLANE,
   TOP_FRUSTUM_PLANE,
   BOTTOM_FRUSTUM_PLANE,
   NEAR_FRUSTUM_PLANE,
-  FAR_FRUSTUM_PLANE
+  FAR_FRUSTUM_PLANE,
+  LEFT_GUARD_BAND_PLANE,
+  RIGHT_GUARD_BAND_PLANE,
+  TOP_GUARD_BAND_PLANE,
+  BOTTOM_GUARD_BAND_PLANE,
+  NUM_CLIP_PLANES
 };
 
+// outcode bits of the view frustum (a triangle outside one of them is not
+// visible) and of the planes triangles actually get clipped against
+#define FRUSTUM_OUTCODES 0x3F
+#define CLIPPING_OUTCODES                                                      \
+  ((1 << NEAR_FRUSTUM_PLANE) | (1 << FAR_FRUSTUM_PLANE) |                      \
+   (1 << LEFT_GUARD_BAND_PLANE) | (1 << RIGHT_GUARD_BAND_PLANE) |              \
+   (1 << TOP_GUARD_BAND_PLANE) | (1 << BOTTOM_GUARD_BAND_PLANE))
+
+// where a bounding volume lies relative to the view frustum
+enum { FRUSTUM_OUTSIDE, FRUSTUM_INTERSECTING, FRUSTUM_INSIDE };
+
 typedef struct {
   vec3_t point;
   vec3_t normal;
 } plane_t;
 
+// a polygon of clip space vertices
 typedef struct {
-  vec3_t vertices[MAX_POLY_VERTICES];
+  vec4_t vertices[MAX_POLY_VERTICES];
   tex2_t texcoords[MAX_POLY_VERTICES];
   int num_vertices;
 } polygon_t;
 
-void init_frustum_planes(float fov_x, float fov_y, float z_near, float z_far);
-polygon_t create_polygon_from_triangle(vec3_t v0, vec3_t v1, vec3_t v2,
+void init_frustum_planes(mat4_t proj_matrix);
+// Set how far out (in multiples of the half screen size) triangles may reach
+// before they are clipped on x and y instead of left to the rasterizer. The
+// band used on each axis is capped by the window size, so that no vertex gets
+// farther than MAX_SCREEN_COORD pixels from the screen origin
+void set_guard_band(float guard_band);
+polygon_t create_polygon_from_triangle(vec4_t v0, vec4_t v1, vec4_t v2,
                                        tex2_t t0, tex2_t t1, tex2_t t2);
-void clip_polygon(polygon_t *polygon);
+// Clip against the planes of CLIPPING_OUTCODES that are set in outcodes
+// (usually the union of the polygon's vertex outcodes)
+void clip_polygon(polygon_t *polygon, int outcodes);
+// Bit (1 << plane) is set for every clip plane the clip space point is not
+// strictly inside of. A triangle whose vertex outcodes share a
+// FRUSTUM_OUTCODES bit is entirely outside; one whose outcodes have no
+// CLIPPING_OUTCODES bits needs no clipping
+int compute_outcode(vec4_t point);
+// Classify a camera space bounding sphere, or the clip space corners of a
+// bounding box (any convex hull), against the six frustum planes
+int classify_sphere_in_frustum(vec3_t center, float radius);
+int classify_points_in_frustum(vec4_t points[], int num_points);
 void clip_polygon_against_plane(polygon_t *polygon, int plane);
 void triangles_from_polygon(polygon_t *polygon, triangle_t triangles[],
                             int *num_triangles);
@@ -5,6 +5,18 @@ static SDL_Renderer *renderer = NULL;
 
 static uint32_t *color_buffer = NULL;
 static float *z_buffer = NULL;
+static uint32_t *visibility_buffer = NULL;
+
+// Coarse depth hierarchy over the z-buffer: the farthest depth stored in every
+// DEPTH_BLOCK_SIZE and every DEPTH_TILE_SIZE square of pixels. Depth values
+// only ever get smaller during a frame, so a stale maximum is still a safe
+// (if looser) bound
+static float *z_block_max = NULL;
+static float *z_tile_max = NULL;
+static int z_blocks_x = 0;
+static int z_blocks_y = 0;
+static int z_tiles_x = 0;
+static int z_tiles_y = 0;
 
 static SDL_Texture *color_buffer_texture = NULL;
 static int window_width = 640;
@@ -16,6 +28,11 @@ static int cull_method = 0;
 int get_window_width(void) { return window_width; }
 
 int get_window_height(void) { return window_height; }
+
+rect_t get_screen_rect(void) {
+  rect_t screen = {0, 0, window_width - 1, window_height - 1};
+  return screen;
+}
 /**
  * Initializes an SDL window and the renderer for that window
  *
@@ -63,6 +80,18 @@ bool initialize_window(void) {
   // allocate the required memory for the depth buffer
   z_buffer = (float *)malloc(sizeof(float) * window_width * window_height);
 
+  // the visibility buffer (triangle ids) has one entry per pixel as well
+  visibility_buffer =
+      (uint32_t *)malloc(sizeof(uint32_t) * window_width * window_height);
+
+  // and for the coarse depth levels above it
+  z_blocks_x = (window_width + DEPTH_BLOCK_SIZE - 1) / DEPTH_BLOCK_SIZE;
+  z_blocks_y = (window_height + DEPTH_BLOCK_SIZE - 1) / DEPTH_BLOCK_SIZE;
+  z_tiles_x = (window_width + DEPTH_TILE_SIZE - 1) / DEPTH_TILE_SIZE;
+  z_tiles_y = (window_height + DEPTH_TILE_SIZE - 1) / DEPTH_TILE_SIZE;
+  z_block_max = (float *)malloc(sizeof(float) * z_blocks_x * z_blocks_y);
+  z_tile_max = (float *)malloc(sizeof(float) * z_tiles_x * z_tiles_y);
+
   // Create SDL texture that is used to display the color buffer
   // Remember, the color buffer is just a data structure that holds the pixel
   // values, while the texture is the actual thing that will be displayed, so we
@@ -123,6 +152,92 @@ void clear_z_buffer(void) {
   for (int i = 0; i < window_width * window_height; i++) {
     z_buffer[i] = 1.0;
   }
+  for (int i = 0; i < z_blocks_x * z_blocks_y; i++) {
+    z_block_max[i] = 1.0;
+  }
+  for (int i = 0; i < z_tiles_x * z_tiles_y; i++) {
+    z_tile_max[i] = 1.0;
+  }
+}
+
+/**
+ * Mark every pixel of the visibility buffer as not covered by any triangle
+ */
+void clear_visibility_buffer(void) {
+  for (int i = 0; i < window_width * window_height; i++) {
+    visibility_buffer[i] = NO_TRIANGLE;
+  }
+}
+
+uint32_t *get_color_buffer(void) { return color_buffer; }
+
+uint32_t *get_visibility_buffer(void) { return visibility_buffer; }
+
+float *get_z_buffer(void) { return z_buffer; }
+
+float *get_z_block_max(void) { return z_block_max; }
+
+int get_z_blocks_x(void) { return z_blocks_x; }
+
+float get_z_tiles_max(rect_t rect) {
+  float max_depth = 0.0;
+  int min_tx = rect.min_x / DEPTH_TILE_SIZE;
+  int max_tx = rect.max_x / DEPTH_TILE_SIZE;
+  for (int ty = rect.min_y / DEPTH_TILE_SIZE;
+       ty <= rect.max_y / DEPTH_TILE_SIZE; ty++) {
+    for (int tx = min_tx; tx <= max_tx; tx++) {
+      float tile_max = z_tile_max[(ty * z_tiles_x) + tx];
+      max_depth = tile_max > max_depth ? tile_max : max_depth;
+    }
+  }
+  return max_depth;
+}
+
+void update_z_blocks(int block_y, int min_block_x, int max_block_x) {
+  int min_y = block_y * DEPTH_BLOCK_SIZE;
+  int max_y = min_y + DEPTH_BLOCK_SIZE;
+  if (max_y > window_height)
+    max_y = window_height;
+
+  for (int bx = min_block_x; bx <= max_block_x; bx++) {
+    int min_x = bx * DEPTH_BLOCK_SIZE;
+    int max_x = min_x + DEPTH_BLOCK_SIZE;
+    if (max_x > window_width)
+      max_x = window_width;
+
+    float max_depth = 0.0;
+    for (int y = min_y; y < max_y; y++) {
+      float *row = z_buffer + (window_width * y);
+      for (int x = min_x; x < max_x; x++) {
+        max_depth = row[x] > max_depth ? row[x] : max_depth;
+      }
+    }
+    z_block_max[(block_y * z_blocks_x) + bx] = max_depth;
+  }
+
+  // Refresh the tiles holding the updated blocks from their block maxima
+  int blocks_per_tile = DEPTH_TILE_SIZE / DEPTH_BLOCK_SIZE;
+  int ty = block_y / blocks_per_tile;
+  int first_y = ty * blocks_per_tile;
+  int last_y = first_y + blocks_per_tile;
+  if (last_y > z_blocks_y)
+    last_y = z_blocks_y;
+  for (int tx = min_block_x / blocks_per_tile;
+       tx <= max_block_x / blocks_per_tile; tx++) {
+    int first_x = tx * blocks_per_tile;
+    int last_x = first_x + blocks_per_tile;
+    if (last_x > z_blocks_x)
+      last_x = z_blocks_x;
+
+    float max_depth = 0.0;
+    for (int by = first_y; by < last_y; by++) {
+      for (int bx = first_x; bx < last_x; bx++) {
+        float block_max = z_block_max[(by * z_blocks_x) + bx];
+        max_depth = block_max > max_depth ? block_max : max_depth;
+      }
+    }
+    z_tile_max[(ty * z_tiles_x) + tx] = max_depth;
+  }
 }
 
 float get_zbuffer_at(int x, int y) {
@@ -152,6 +267,17 @@ void draw_pixel(int x, int y, uint32_t color) {
   color_buffer[(window_width * y) + x] = color;
 }
 
+/**
+ * Draw a pixel only if it lies inside the scissor rectangle
+ */
+void draw_pixel_scissored(int x, int y, uint32_t color, rect_t scissor) {
+  if (x < scissor.min_x || x > scissor.max_x || y < scissor.min_y ||
+      y > scissor.max_y) {
+    return;
+  }
+  color_buffer[(window_width * y) + x] = color;
+}
+
 /**
  *
  */
@@ -251,9 +377,14 @@ bool should_render_filled_triangles(void) {
 
 bool should_render_textured_triangles(void) {
   return (render_method == RENDER_TEXTURED ||
+          render_method == RENDER_TEXTURED_BILINEAR ||
           render_method == RENDER_TEXTURED_WIRE);
 }
 
+bool should_filter_textures(void) {
+  return (render_method == RENDER_TEXTURED_BILINEAR);
+}
+
 bool should_render_wireframe(void) {
   return (render_method == RENDER_WIRE || render_method == RENDER_WIRE_VERTEX ||
           render_method == RENDER_FILL_TRIANGLE_WIRE ||
@@ -264,6 +395,10 @@ bool should_render_wire_vertex(void) {
   return (render_method == RENDER_WIRE_VERTEX);
 }
 
+bool should_render_visibility_buffer(void) {
+  return (render_method == RENDER_VISIBILITY);
+}
+
 /**
  * Just a test function to draw a grid to the color buffer, will prob delete
  * this
@@ -292,11 +427,19 @@ void draw_grid(uint32_t color1, uint32_t color2) {
  * @param  color: color of rectangle
  */
 void draw_rect(int x, int y, int width, int height, uint32_t color) {
+  draw_rect_scissored(x, y, width, height, color, get_screen_rect());
+}
+
+/**
+ * Draw a rectangle to the color buffer, skipping pixels outside scissor
+ */
+void draw_rect_scissored(int x, int y, int width, int height, uint32_t color,
+                         rect_t scissor) {
   for (int i = 0; i < width; i++) {
     for (int j = 0; j < height; j++) {
       int current_x = x + i;
       int current_y = y + j;
-      draw_pixel(current_x, current_y, color);
+      draw_pixel_scissored(current_x, current_y, color, scissor);
     }
   }
 }
@@ -312,6 +455,16 @@ void draw_rect(int x, int y, int width, int height, uint32_t color) {
  * @param: color : color to draw line in
  */
 void draw_line(int x0, int y0, int x1, int y1, uint32_t color) {
+  draw_line_scissored(x0, y0, x1, y1, color, get_screen_rect());
+}
+
+/**
+ * Draw a line to the color buffer, skipping pixels outside scissor. The line
+ * is always stepped from (x0,y0), so splitting the screen into several
+ * scissor rectangles draws exactly the same pixels as one full-screen call
+ */
+void draw_line_scissored(int x0, int y0, int x1, int y1, uint32_t color,
+                         rect_t scissor) {
   int delta_x = (x1 - x0);
   int delta_y = (y1 - y0);
 
@@ -326,8 +479,8 @@ void draw_line(int x0, int y0, int x1, int y1, uint32_t color) {
 
   for (int i = 0; i <= side_length; i++) {
     // draw_pixel(round(current_x), round(current_y), color);
-    draw_pixel(round(current_x), round(current_y),
-               color); // experimenting. delete when continuing course
+    // experimenting. delete when continuing course
+    draw_pixel_scissored(round(current_x), round(current_y), color, scissor);
     current_x += x_inc;
     current_y += y_inc;
   }
@@ -336,6 +489,9 @@ void draw_line(int x0, int y0, int x1, int y1, uint32_t color) {
 void destroy_window(void) {
   free(color_buffer);
   free(z_buffer);
+  free(visibility_buffer);
+  free(z_block_max);
+  free(z_tile_max);
   SDL_DestroyRenderer(renderer);
   SDL_DestroyWindow(window);
   SDL_Quit();
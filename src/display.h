@@ -8,6 +8,16 @@
 #define FPS 120
 #define FRAME_TARGET_TIME (1000 / FPS)
 
+// Sizes (in pixels) of the squares of the coarse depth levels kept above the
+// z-buffer. The depth tile must fit a whole number of times in a screen tile
+// (TILE_SIZE) so each one belongs to a single render thread
+#define DEPTH_BLOCK_SIZE 8
+#define DEPTH_TILE_SIZE 64
+
+#if DEPTH_TILE_SIZE % DEPTH_BLOCK_SIZE != 0
+#error "DEPTH_TILE_SIZE must be a multiple of DEPTH_BLOCK_SIZE"
+#endif
+
 enum cull_method { CULL_NONE, CULL_BACKFACE };
 
 enum render_method {
@@ -16,15 +26,33 @@ enum render_method {
   RENDER_FILL_TRIANGLE,
   RENDER_FILL_TRIANGLE_WIRE,
   RENDER_TEXTURED,
-  RENDER_TEXTURED_WIRE
+  RENDER_TEXTURED_BILINEAR,
+  RENDER_TEXTURED_WIRE,
+  RENDER_VISIBILITY
 };
 
+// visibility buffer value of pixels no triangle has been drawn to
+#define NO_TRIANGLE 0xFFFFFFFF
+
+// inclusive screen-space rectangle that drawing is limited to (scissor)
+typedef struct {
+  int min_x;
+  int min_y;
+  int max_x;
+  int max_y;
+} rect_t;
+
 /**
  * get window dimensions
  */
 int get_window_width(void);
 int get_window_height(void);
 
+/**
+ * get the rectangle covering the whole window
+ */
+rect_t get_screen_rect(void);
+
 /**
  * set render method (textured, wireframe, solid)
  */
@@ -63,6 +91,37 @@ void clear_color_buffer(uint32_t color);
 
 void clear_z_buffer(void);
 
+/**
+ * get the raw color and depth buffers (window_width * window_height pixels,
+ * row-major) for rasterizer loops that do their own bounds handling
+ */
+uint32_t *get_color_buffer(void);
+float *get_z_buffer(void);
+
+/**
+ * The visibility buffer holds, for every pixel, the render queue index of the
+ * triangle covering it (NO_TRIANGLE when there is none). It is only used by
+ * the RENDER_VISIBILITY method, which shades the frame from it afterwards
+ */
+uint32_t *get_visibility_buffer(void);
+void clear_visibility_buffer(void);
+
+/**
+ * Coarse depth hierarchy: the farthest depth of every DEPTH_BLOCK_SIZE block
+ * (get_z_blocks_x blocks per row) and the farthest depth of the depth tiles
+ * overlapping rect. A triangle whose nearest depth is not in front of these
+ * can not pass the depth test anywhere inside them
+ */
+float *get_z_block_max(void);
+int get_z_blocks_x(void);
+float get_z_tiles_max(rect_t rect);
+
+/**
+ * Recompute the farthest depth of blocks min_block_x to max_block_x of block
+ * row block_y, and of the depth tiles holding them, after drawing into them
+ */
+void update_z_blocks(int block_y, int min_block_x, int max_block_x);
+
 float get_zbuffer_at(int x, int y);
 void set_zbuffer_at(int x, int y, float value);
 
@@ -70,6 +129,7 @@ void set_zbuffer_at(int x, int y, float value);
  *
  */
 void draw_pixel(int x, int y, uint32_t color);
+void draw_pixel_scissored(int x, int y, uint32_t color, rect_t scissor);
 
 /**
  * Draw a rectangle to the color buffer
@@ -81,6 +141,8 @@ void draw_pixel(int x, int y, uint32_t color);
  * @param  color: color of rectangle
  */
 void draw_rect(int xPos, int yPos, int width, int height, uint32_t color);
+void draw_rect_scissored(int xPos, int yPos, int width, int height,
+                         uint32_t color, rect_t scissor);
 
 /**
  * Draw a line to the color buffer using a DDA (digital differential analyzer)
@@ -93,6 +155,8 @@ void draw_rect(int xPos, int yPos, int width, int height, uint32_t color);
  * @param: color : color to draw line in
  */
 void draw_line(int x0, int y0, int x1, int y1, uint32_t color);
+void draw_line_scissored(int x0, int y0, int x1, int y1, uint32_t color,
+                         rect_t scissor);
 
 /**
  * Just a test function to draw a grid to the color buffer, will prob delete
@@ -107,8 +171,10 @@ void draw_horizon();
 
 bool should_render_filled_triangles(void);
 bool should_render_textured_triangles(void);
+bool should_filter_textures(void);
 bool should_render_wireframe(void);
 bool should_render_wire_vertex(void);
+bool should_render_visibility_buffer(void);
 
 void destroy_window(void);
 #endif
@@ -0,0 +1,95 @@
+#include "jobs.h"
+#include <SDL2/SDL.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+static SDL_Thread *workers[MAX_JOB_THREADS];
+static int num_workers = 0;
+static SDL_sem *work_ready = NULL;
+static SDL_sem *work_done = NULL;
+static bool shutting_down = false;
+
+// The batch of jobs currently running, shared with the workers
+static job_fn batch_job = NULL;
+static void *batch_data = NULL;
+static int batch_size = 0;
+static SDL_atomic_t next_job;
+
+/**
+ * Take jobs from the current batch until there are none left
+ */
+static void work_on_batch(void) {
+  int job_index;
+  while ((job_index = SDL_AtomicAdd(&next_job, 1)) < batch_size) {
+    batch_job(job_index, batch_data);
+  }
+}
+
+static int job_worker(void *data) {
+  (void)data;
+  while (true) {
+    SDL_SemWait(work_ready);
+    if (shutting_down) {
+      break;
+    }
+    work_on_batch();
+    SDL_SemPost(work_done);
+  }
+  return 0;
+}
+
+void init_jobs(int num_threads) {
+  if (num_threads < 1)
+    num_threads = 1;
+  if (num_threads > MAX_JOB_THREADS)
+    num_threads = MAX_JOB_THREADS;
+
+  work_ready = SDL_CreateSemaphore(0);
+  work_done = SDL_CreateSemaphore(0);
+  shutting_down = false;
+
+  num_workers = 0;
+  for (int i = 0; i < num_threads - 1; i++) {
+    SDL_Thread *worker = SDL_CreateThread(job_worker, "job worker", NULL);
+    if (!worker) {
+      fprintf(stderr, "Error creating job worker: %s\n", SDL_GetError());
+      break;
+    }
+    workers[num_workers++] = worker;
+  }
+}
+
+int get_job_threads(void) { return num_workers + 1; }
+
+void run_jobs(int num_jobs, job_fn job, void *data) {
+  batch_job = job;
+  batch_data = data;
+  batch_size = num_jobs;
+  SDL_AtomicSet(&next_job, 0);
+
+  // Wake the workers and help them out on this thread. The semaphores order
+  // the batch setup above before the workers read it, and the jobs' results
+  // before the return
+  int num_woken = num_workers < num_jobs ? num_workers : num_jobs;
+  for (int i = 0; i < num_woken; i++) {
+    SDL_SemPost(work_ready);
+  }
+  work_on_batch();
+  for (int i = 0; i < num_woken; i++) {
+    SDL_SemWait(work_done);
+  }
+}
+
+void destroy_jobs(void) {
+  shutting_down = true;
+  for (int i = 0; i < num_workers; i++) {
+    SDL_SemPost(work_ready);
+  }
+  for (int i = 0; i < num_workers; i++) {
+    SDL_WaitThread(workers[i], NULL);
+  }
+  num_workers = 0;
+
+  SDL_DestroySemaphore(work_ready);
+  SDL_DestroySemaphore(work_done);
+}
@@ -0,0 +1,26 @@
+#ifndef JOBS_H
+#define JOBS_H
+
+#define MAX_JOB_THREADS 64
+
+// A job is one numbered piece of a parallel loop
+typedef void (*job_fn)(int job_index, void *data);
+
+/**
+ * Start num_threads - 1 worker threads. The thread calling run_jobs() always
+ * works as well, so num_threads = 1 runs every job inline
+ */
+void init_jobs(int num_threads);
+
+int get_job_threads(void);
+
+/**
+ * Run job(0, data) ... job(num_jobs - 1, data) spread over all threads and
+ * return once every job has finished. Jobs are handed out one at a time, so
+ * a few expensive jobs don't hold up the rest. Must not be called from a job
+ */
+void run_jobs(int num_jobs, job_fn job, void *data);
+
+void destroy_jobs(void);
+
+#endif
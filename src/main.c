@@ -1,11 +1,15 @@
+#include "arena.h"
 #include "array.h"
 #include "camera.h"
 #include "clipping.h"
 #include "display.h"
+#include "jobs.h"
 #include "light.h"
 #include "matrix.h"
 #include "mesh.h"
+#include "sort.h"
 #include "texture.h"
+#include "tiles.h"
 #include "triangle.h"
 #include "upng.h"
 #include "vector.h"
@@ -13,6 +17,8 @@
 #include <math.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 bool is_running = false;
 int previous_frame_time = 0;
@@ -20,16 +26,64 @@ float delta_time = 0;
 int grid_bg;
 int grid_fg;
 
-// an array of triangles to be rendered frame by frame
-// switched to static array so we don't have to reallocate a dynamic array every
-// frame
-#define MAX_TRIANGLES 10000
-triangle_t triangles_to_render[MAX_TRIANGLES];
+// the triangles to be rendered frame by frame, as two arrays indexed the same
+// way: their positions and their shading attributes. They live in the frame
+// arena, which is reset (not freed) every frame and grows to the largest frame
+// seen, so there is no cap on the number of triangles and no reallocation once
+// the scene has been on screen for a frame
+arena_t frame_arena = {NULL};
+triangle_position_t *triangle_positions = NULL;
+triangle_shading_t *triangle_shadings = NULL;
 int num_triangles_to_render = 0;
 
+// draw the render queue sorted front to back (toggled with 9 and 0)
+bool sort_front_to_back = true;
+
+// lay down the depth of the whole frame before shading it, so every pixel is
+// shaded (and textured) at most once (toggled with p)
+bool z_prepass = false;
+
+// sample distant textures from their smaller mip levels (toggled with m)
+bool mipmapping = true;
+
 mat4_t proj_matrix;
 mat4_t view_matrix;
 
+// pack the mesh textures into shared atlas pages at load time (turned off with
+// "--texture-atlas off")
+bool texture_atlas = true;
+
+// number of threads used for the geometry and rasterization stages
+// (0 = one per CPU core)
+int render_threads = 0;
+
+// vertices are transformed and faces processed in chunks of this many
+// vertices/faces, spread over the job threads
+#define VERTICES_PER_CHUNK 1024
+#define FACES_PER_CHUNK 256
+
+// a run of consecutive vertices of one mesh
+typedef struct {
+  int mesh_index;
+  int first_vertex;
+  int last_vertex; // one past the last vertex of the chunk
+} vertex_chunk_t;
+
+// a run of consecutive faces of one mesh and the triangles it produced
+typedef struct {
+  int mesh_index;
+  int first_face;
+  int last_face;                  // one past the last face of the chunk
+  triangle_position_t *positions; // dynamic arrays of projected triangles
+  triangle_shading_t *shadings;
+} geometry_chunk_t;
+
+// dynamic arrays of this frame's vertex and geometry chunks
+vertex_chunk_t *vertex_chunks = NULL;
+int num_vertex_chunks = 0;
+geometry_chunk_t *geometry_chunks = NULL;
+int num_geometry_chunks = 0;
+
 /**
  * Allocate required memory for color buffer and create the SDL texture
  * that is used to display it
@@ -43,22 +97,33 @@ void setup(void) {
   init_light(vec3_new(0, 0, 1));
 
   // initialize perspective projection matrix
-  float aspect_ratio_x = (float)get_window_width() / (float)get_window_height();
   float aspect_ratio_y = (float)get_window_height() / (float)get_window_width();
   float fov_y = 3.14159 / 3.0; // 60 deg in radians
-  float fov_x = atan(tan(fov_y / 2) * aspect_ratio_x) * 2.0;
   float z_near = 0.1;
   float z_far = 100.0;
   proj_matrix = mat4_make_perspective(fov_y, aspect_ratio_y, z_near, z_far);
 
-  // Initialize frustum planes with a point and a normal
-  init_frustum_planes(fov_x, fov_y, z_near, z_far);
+  // Initialize the camera space frustum planes from the projection matrix
+  init_frustum_planes(proj_matrix);
+
+  // Start the worker threads and split the screen into tiles
+  if (render_threads <= 0) {
+    render_threads = SDL_GetCPUCount();
+  }
+  init_jobs(render_threads);
+  init_tile_renderer();
 
   // Load mesh data
   load_mesh("./assets/f22.obj", "./assets/f22.png", vec3_new(1, 1, 1),
             vec3_new(-3, 0, +8), vec3_new(0, 0, 0));
   load_mesh("./assets/efa.obj", "./assets/efa.png", vec3_new(1, 1, 1),
             vec3_new(+3, 0, +9), vec3_new(0, 0, 0));
+
+  // Share texture pages between the meshes, so the (texture sorted) render
+  // queue barely switches textures
+  if (texture_atlas) {
+    pack_mesh_textures();
+  }
 }
 
 /**
@@ -106,11 +171,23 @@ void process_input(void) {
         set_render_method(RENDER_TEXTURED);
         break;
       }
+      // If b is pressed, set render method to textured with bilinear
+      // filtering
+      if (event.key.keysym.sym == SDLK_b) {
+        set_render_method(RENDER_TEXTURED_BILINEAR);
+        break;
+      }
       // If 6 is pressed, set render method to textured+wire
       if (event.key.keysym.sym == SDLK_6) {
         set_render_method(RENDER_TEXTURED_WIRE);
         break;
       }
+      // If v is pressed, set render method to textured through the
+      // visibility buffer
+      if (event.key.keysym.sym == SDLK_v) {
+        set_render_method(RENDER_VISIBILITY);
+        break;
+      }
       // If 7 is pressed, enable backface culling
       if (event.key.keysym.sym == SDLK_7) {
         set_cull_method(CULL_BACKFACE);
@@ -121,6 +198,26 @@ void process_input(void) {
         set_cull_method(CULL_NONE);
         break;
       }
+      // If 9 is pressed, sort the triangles front to back before drawing
+      if (event.key.keysym.sym == SDLK_9) {
+        sort_front_to_back = true;
+        break;
+      }
+      // If 0 is pressed, draw the triangles in mesh/face order
+      if (event.key.keysym.sym == SDLK_0) {
+        sort_front_to_back = false;
+        break;
+      }
+      // If p is pressed, switch the depth prepass on or off
+      if (event.key.keysym.sym == SDLK_p) {
+        z_prepass = !z_prepass;
+        break;
+      }
+      // If m is pressed, switch mipmapping on or off
+      if (event.key.keysym.sym == SDLK_m) {
+        mipmapping = !mipmapping;
+        break;
+      }
       // up arrow: float upward
       if (event.key.keysym.sym == SDLK_UP) {
         move_camera_y(3.0 * delta_time);
@@ -170,6 +267,265 @@ void process_input(void) {
   }
 }
 
+/**
+ * Group the render queue by texture (atlas page), and order every group front
+ * to back so the depth test (and the hierarchical depth rejection) throws away
+ * hidden triangles before they get shaded. The sort key is the texture handle
+ * in the top 8 bits above the w of the triangle's nearest vertex, without its
+ * low mantissa bits. Positive floats compare like their bit patterns, which
+ * lets a radix sort order them
+ */
+void sort_render_queue(void) {
+  int n = num_triangles_to_render;
+  uint32_t *keys = (uint32_t *)arena_alloc(&frame_arena, n * sizeof(uint32_t));
+  uint32_t *key_scratch =
+      (uint32_t *)arena_alloc(&frame_arena, n * sizeof(uint32_t));
+  int *order = (int *)arena_alloc(&frame_arena, n * sizeof(int));
+  int *order_scratch = (int *)arena_alloc(&frame_arena, n * sizeof(int));
+
+  for (int i = 0; i < n; i++) {
+    vec3_t reciprocal_w = triangle_positions[i].reciprocal_w;
+    float max_reciprocal_w = fmaxf(fmaxf(reciprocal_w.x, reciprocal_w.y),
+                                   reciprocal_w.z);
+    float nearest_w = 1.0 / max_reciprocal_w;
+    uint32_t depth_bits;
+    memcpy(&depth_bits, &nearest_w, sizeof(depth_bits));
+
+    // textures past the 255th share the last group
+    int texture = get_texture_page(triangle_shadings[i].texture) + 1;
+    if (texture > 0xFF)
+      texture = 0xFF;
+
+    keys[i] = ((uint32_t)texture << 24) | (depth_bits >> 8);
+    order[i] = i;
+  }
+
+  radix_sort(keys, order, key_scratch, order_scratch, n);
+
+  triangle_position_t *sorted_positions = (triangle_position_t *)arena_alloc(
+      &frame_arena, n * sizeof(triangle_position_t));
+  triangle_shading_t *sorted_shadings = (triangle_shading_t *)arena_alloc(
+      &frame_arena, n * sizeof(triangle_shading_t));
+  for (int i = 0; i < n; i++) {
+    sorted_positions[i] = triangle_positions[order[i]];
+    sorted_shadings[i] = triangle_shadings[order[i]];
+  }
+  triangle_positions = sorted_positions;
+  triangle_shadings = sorted_shadings;
+}
+
+/**
+ * Job transforming one chunk of a mesh's vertices to clip space, filling
+ * that part of the mesh's transformed vertex buffer
+ */
+void transform_vertex_chunk(int chunk_index, void *data) {
+  (void)data;
+  vertex_chunk_t *chunk = &vertex_chunks[chunk_index];
+  mesh_t *mesh = get_mesh(chunk->mesh_index);
+
+  // Multiply the mesh's model-view-projection matrix (built once per frame in
+  // update()) by the original vertices to transform them to world, camera and
+  // then clip space in one go, saving them in the mesh's array of transformed
+  // vertices
+  mesh_transform_vertices(mesh, &mesh->model_view_projection_matrix,
+                          chunk->first_vertex,
+                          chunk->last_vertex - chunk->first_vertex,
+                          &mesh->transformed_vertices[chunk->first_vertex]);
+
+  // Classify every vertex against the clip planes once, so faces can be
+  // accepted or rejected without running the clipper. Meshes entirely inside
+  // the frustum skip this
+  if (mesh->frustum_visibility != FRUSTUM_INSIDE) {
+    for (int i = chunk->first_vertex; i < chunk->last_vertex; i++) {
+      mesh->vertex_outcodes[i] = compute_outcode(mesh->transformed_vertices[i]);
+    }
+  }
+}
+
+/**
+ * Job culling, clipping and projecting the faces of one geometry chunk into
+ * the chunk's own list of triangles
+ */
+void process_geometry_chunk(int chunk_index, void *data) {
+  (void)data;
+  geometry_chunk_t *chunk = &geometry_chunks[chunk_index];
+  mesh_t *mesh = get_mesh(chunk->mesh_index);
+  array_clear(chunk->positions);
+  array_clear(chunk->shadings);
+
+  // loop the triangle faces of this chunk
+  for (int i = chunk->first_face; i < chunk->last_face; i++) {
+    // The face's plane was precomputed in object space when the mesh was
+    // loaded: its unit normal in xyz and its distance from the origin in w
+    vec4_t face_plane = mesh->face_planes[i];
+    vec3_t face_normal = {face_plane.x, face_plane.y, face_plane.z};
+
+    // Backface culling (if enabled by user)
+    if (is_cull_backface()) {
+      // Cull in object space, against the camera position moved into the
+      // mesh's local frame once per frame. A face is pointing away from the
+      // camera when the camera lies behind its plane
+      float camera_distance =
+          vec3_dot(face_normal, mesh->object_camera) - face_plane.w;
+
+      // if the face normal is pointing away from camera ray...
+      if (camera_distance * mesh->handedness < 0) {
+        //...bypass the following section that would normally fetch and
+        // project this face
+        continue;
+      }
+    }
+
+    int vertex_a = mesh_face_vertex(mesh, i, 0);
+    int vertex_b = mesh_face_vertex(mesh, i, 1);
+    int vertex_c = mesh_face_vertex(mesh, i, 2);
+
+    // Trivially accept or reject the face from its vertex outcodes: only
+    // faces crossing the near or far plane, or reaching past the guard band,
+    // need the polygon clipper
+    int clip_outcodes = 0;
+    if (mesh->frustum_visibility != FRUSTUM_INSIDE) {
+      int outcode_a = mesh->vertex_outcodes[vertex_a];
+      int outcode_b = mesh->vertex_outcodes[vertex_b];
+      int outcode_c = mesh->vertex_outcodes[vertex_c];
+      // all outside the same frustum plane
+      if (outcode_a & outcode_b & outcode_c & FRUSTUM_OUTCODES) {
+        continue;
+      }
+      clip_outcodes = (outcode_a | outcode_b | outcode_c) & CLIPPING_OUTCODES;
+    }
+
+    // Fetch the clip space vertices of this face. Every vertex was
+    // transformed exactly once this frame, however many faces share it
+    vec4_t transformed_vertices[3];
+    transformed_vertices[0] = mesh->transformed_vertices[vertex_a];
+    transformed_vertices[1] = mesh->transformed_vertices[vertex_b];
+    transformed_vertices[2] = mesh->transformed_vertices[vertex_c];
+
+    // Bring the face normal to camera space for lighting
+    vec4_t camera_normal = mat4_mul_vec4(
+        mesh->normal_matrix,
+        (vec4_t){face_normal.x, face_normal.y, face_normal.z, 0});
+    vec3_t normal = vec3_from_vec4(camera_normal);
+    vec3_normalize(&normal);
+
+    //////////////////
+    // CLIPPING LOGIC:
+    //////////////////
+
+    // Create a polygon from the original transformed triangle to be clipped
+    polygon_t polygon = create_polygon_from_triangle(
+        transformed_vertices[0], transformed_vertices[1],
+        transformed_vertices[2], mesh_face_uv(mesh, i, 0),
+        mesh_face_uv(mesh, i, 1), mesh_face_uv(mesh, i, 2));
+
+    // Clip the polygon and returns a new polygon with potential new vertices.
+    // Only the planes some vertex is outside of are clipped against; the
+    // screen edges are left to the rasterizer's scissor
+    if (clip_outcodes) {
+      clip_polygon(&polygon, clip_outcodes);
+    }
+
+    // Break the clipped polygon apart back into individual triangles
+    triangle_t triangles_after_clipping[MAX_POLY_TRIANGLES];
+    int num_triangles_after_clipping = 0;
+
+    triangles_from_polygon(&polygon, triangles_after_clipping,
+                           &num_triangles_after_clipping);
+
+    // Loop all assembled triangles after clipping
+    for (int t = 0; t < num_triangles_after_clipping; t++) {
+      triangle_t triangle_after_clipping = triangles_after_clipping[t];
+
+      vec4_t projected_points[3];
+
+      // loop all vertices of triangles NOT excluded by backface culling and
+      // finally project them
+      for (int j = 0; j < 3; j++) {
+
+        // the vertex is already in clip space (multiplied by the projection
+        // matrix)
+        projected_points[j] = triangle_after_clipping.points[j];
+
+        // Perform perspective divide
+        if (projected_points[j].w != 0) {
+          projected_points[j].x /= projected_points[j].w;
+          projected_points[j].y /= projected_points[j].w;
+          projected_points[j].z /= projected_points[j].w;
+        }
+
+        // On-screen y coordinates are processed in the opposite direction in
+        // which they are read in from .obj files, so we will invert y
+        // coordinates here
+        projected_points[j].y *= -1;
+
+        // scale into view using window dimensions
+        projected_points[j].x *= (get_window_width() / 2.0);
+        projected_points[j].y *= (get_window_height() / 2.0);
+
+        // scale and translate the projected points to the middle of screen
+        projected_points[j].x += (get_window_width() / 2.0);
+        projected_points[j].y += (get_window_height() / 2.0);
+      }
+
+      // (the triangles are put in depth order for drawing by
+      // sort_render_queue once all chunks are done)
+
+      // Calculate shade intensity based on how aligned the face normal and
+      // light normal are
+      float light_intensity_factor = -vec3_dot(normal, get_light_direction());
+
+      // Calculate triangle color based on light angle
+      uint32_t triangle_color = light_apply_intensity(mesh_face_color(mesh, i),
+                                                      light_intensity_factor);
+
+      // Flip the V component to account for inverted UV-coordinates (V grows
+      // downwards)
+      tex2_t *texcoords = triangle_after_clipping.texcoords;
+      float v0 = 1.0 - texcoords[0].v;
+      float v1 = 1.0 - texcoords[1].v;
+      float v2 = 1.0 - texcoords[2].v;
+      float w0 = projected_points[0].w;
+      float w1 = projected_points[1].w;
+      float w2 = projected_points[2].w;
+
+      // Now using the data we created, we actually create the triangle to
+      // render, split into its position and its shading attributes the way
+      // the rasterizer reads it: U/w, V/w and 1/w are linear in screen space,
+      // so each vertex attribute is divided by w once here instead of by every
+      // tile drawing it
+      triangle_position_t position = {
+          // assign triangle points (taken from the points we just processed
+          // (projected)), snapped to the subpixel grid
+          .x = {snap_to_subpixel(projected_points[0].x),
+                snap_to_subpixel(projected_points[1].x),
+                snap_to_subpixel(projected_points[2].x)},
+          .y = {snap_to_subpixel(projected_points[0].y),
+                snap_to_subpixel(projected_points[1].y),
+                snap_to_subpixel(projected_points[2].y)},
+          /*
+          // AFFINE MAPPING
+          .points = {
+              { projected_points[0].x, projected_points[0].y },
+              { projected_points[1].x, projected_points[1].y },
+              { projected_points[2].x, projected_points[2].y }
+          },*/
+          .reciprocal_w = {1 / w0, 1 / w1, 1 / w2}};
+      triangle_shading_t shading = {
+          .u_over_w = {texcoords[0].u / w0, texcoords[1].u / w1,
+                       texcoords[2].u / w2},
+          .v_over_w = {v0 / w0, v1 / w1, v2 / w2},
+          // assign this triangle's texture and color
+          .color = triangle_color,
+          .texture = mesh->texture_handle};
+
+      // save the projected triangle in this chunk's own lists of triangles
+      array_push(chunk->positions, position);
+      array_push(chunk->shadings, shading);
+    }
+  }
+}
+
 void update(void) {
   // block program until we have reached the millisecond duration we designated
   // for 1 frame in FRAME_TARGET_TIME (for 30 fps that's 33.333ms) this locks
@@ -193,10 +549,17 @@ void update(void) {
     grid_fg = 0x00000100;
   }
 
-  // Initialize counter of triangles to render for the current frame
-  num_triangles_to_render = 0;
+  // Update camera look at target to create view matrix
+  vec3_t target = get_camera_lookat_target();
+  vec3_t up_direction = vec3_new(0, 1, 0);
+
+  // Create the view matrix
+  view_matrix = mat4_look_at(get_camera_position(), target, up_direction);
 
-  // Loop all the meshes of our scene
+  // Split the vertices and the faces of all the meshes of our scene into
+  // chunks
+  num_vertex_chunks = 0;
+  num_geometry_chunks = 0;
   for (int mesh_index = 0; mesh_index < get_num_meshes(); mesh_index++) {
     mesh_t *mesh = get_mesh(mesh_index);
     // If you want to change mesh scale/rotation values on every frame:
@@ -209,212 +572,169 @@ void update(void) {
     // camera.position.x += 0.008 * delta_time;
     // camera.position.y += 0.008 * delta_time;
 
-    // Create scale, translation and rotation matrices that will be used to
-    // multiply the mesh vertices, passing in the corresponding values (that are
-    // changing over time) in the mesh struct of the corresponding object
-    mat4_t scale_matrix =
-        mat4_make_scale(mesh->scale.x, mesh->scale.y, mesh->scale.z);
-    mat4_t translation_matrix = mat4_make_translation(
-        mesh->translation.x, mesh->translation.y, mesh->translation.z);
-    mat4_t rotation_matrix_x = mat4_make_rotation_x(mesh->rotation.x);
-    mat4_t rotation_matrix_y = mat4_make_rotation_y(mesh->rotation.y);
-    mat4_t rotation_matrix_z = mat4_make_rotation_z(mesh->rotation.z);
-
-    // Update camera look at target to create view matrix
-    vec3_t target = get_camera_lookat_target();
-    vec3_t up_direction = vec3_new(0, 1, 0);
-
-    // Create the view matrix
-    view_matrix = mat4_look_at(get_camera_position(), target, up_direction);
-
-    // loop all triangle faces of our mesh
-    int num_faces = array_length(mesh->faces);
-    for (int i = 0; i < num_faces; i++) {
-      face_t mesh_face = mesh->faces[i];
-
-      vec3_t face_vertices[3];
-      face_vertices[0] = mesh->vertices[mesh_face.a - 1];
-      face_vertices[1] = mesh->vertices[mesh_face.b - 1];
-      face_vertices[2] = mesh->vertices[mesh_face.c - 1];
-
-      vec4_t transformed_vertices[3];
-
-      // loop all 3 vertices of this current face and apply transformations
-      for (int j = 0; j < 3; j++) {
-        vec4_t transformed_vertex = vec4_from_vec3(face_vertices[j]);
-
-        // Create a World Matrix combining scale, rotation and translation
-        // matrices Since matrix multiplication is not commutative, order
-        // matters! (scale, rotate, translate)
-        mat4_t world_matrix = mat4_identity();
-        // multiply w_m by scale to store scale scalars within it
-        world_matrix = mat4_mul_mat4(scale_matrix, world_matrix);
-        // multiply w_m by rotation matrices to store rotation scalars within it
-        world_matrix = mat4_mul_mat4(rotation_matrix_z, world_matrix);
-        world_matrix = mat4_mul_mat4(rotation_matrix_y, world_matrix);
-        world_matrix = mat4_mul_mat4(rotation_matrix_x, world_matrix);
-        // multiply w_m by translation matrix to store translation scalars
-        // within it
-        world_matrix = mat4_mul_mat4(translation_matrix, world_matrix);
-
-        // Multiply world matrix by the original vector to transform scene to
-        // world space
-        transformed_vertex = mat4_mul_vec4(world_matrix, transformed_vertex);
-
-        // Multiply the view matrix by the vector to then transform scene to
-        // camera space
-        transformed_vertex = mat4_mul_vec4(view_matrix, transformed_vertex);
-
-        // Save this transformed vertex (after being scaled/translated/rotated)
-        // in the array of transformed vertices
-        transformed_vertices[j] = transformed_vertex;
-      }
+    // Refresh the mesh's model-view(-projection) matrices if the mesh or the
+    // camera moved since the last frame
+    update_mesh_transform(mesh, view_matrix, proj_matrix);
 
-      // label each vertex of this given triangle for the sake of simplicity
-      vec3_t vector_a = vec3_from_vec4(transformed_vertices[0]);
-      vec3_t vector_b = vec3_from_vec4(transformed_vertices[1]);
-      vec3_t vector_c = vec3_from_vec4(transformed_vertices[2]);
-
-      // culling step 1: find vectors B-A and C-A
-      vec3_t vector_ab = vec3_sub(vector_b, vector_a);
-      vec3_t vector_ac = vec3_sub(vector_c, vector_a);
-      vec3_normalize(&vector_ab);
-      vec3_normalize(&vector_ac);
-
-      // culling step 2: take their cross product and find the perpendicular
-      // normal
-      vec3_t normal = vec3_cross(vector_ab, vector_ac);
-      vec3_normalize(&normal);
-
-      // culling step 3: find the camera ray vector by subtracting camera
-      // position from point A
-      vec3_t origin = {0, 0, 0};
-      vec3_t camera_ray = vec3_sub(origin, vector_a);
-
-      // culling step 4: take dot product between normal and camera ray,
-      // if the dot product is < 0, face is pointing away from camera, do not
-      // display the face
-      float dot_normal_camera = vec3_dot(normal, camera_ray);
-
-      // Backface culling (if enabled by user)
-      if (is_cull_backface()) {
-
-        // if the face normal is pointing away from camera ray...
-        if (dot_normal_camera < 0) {
-          //...bypass the following section that would normally project this
-          //face
-          continue;
-        }
-      }
-
-      //////////////////
-      // CLIPPING LOGIC:
-      //////////////////
+    // Meshes entirely outside the view frustum cost this one test: none of
+    // their vertices or faces are processed
+    if (classify_mesh_in_frustum(mesh) == FRUSTUM_OUTSIDE) {
+      continue;
+    }
 
-      // Create a polygon from the original transformed triangle to be clipped
-      polygon_t polygon = create_polygon_from_triangle(
-          vec3_from_vec4(transformed_vertices[0]),
-          vec3_from_vec4(transformed_vertices[1]),
-          vec3_from_vec4(transformed_vertices[2]), mesh_face.a_uv,
-          mesh_face.b_uv, mesh_face.c_uv);
+    int num_vertices = mesh_num_vertices(mesh);
+    for (int first_vertex = 0; first_vertex < num_vertices;
+         first_vertex += VERTICES_PER_CHUNK) {
+      if (num_vertex_chunks == array_length(vertex_chunks)) {
+        vertex_chunk_t new_chunk = {.mesh_index = 0};
+        array_push(vertex_chunks, new_chunk);
+      }
+      vertex_chunk_t *chunk = &vertex_chunks[num_vertex_chunks++];
+      chunk->mesh_index = mesh_index;
+      chunk->first_vertex = first_vertex;
+      chunk->last_vertex = first_vertex + VERTICES_PER_CHUNK < num_vertices
+                               ? first_vertex + VERTICES_PER_CHUNK
+                               : num_vertices;
+    }
 
-      // Clip the polygon and returns a new polygon with potential new vertices
-      clip_polygon(&polygon);
+    int num_faces = mesh_num_faces(mesh);
+    for (int first_face = 0; first_face < num_faces;
+         first_face += FACES_PER_CHUNK) {
+      // Chunks (and their triangle lists) are kept between frames
+      if (num_geometry_chunks == array_length(geometry_chunks)) {
+        geometry_chunk_t new_chunk = {.positions = NULL, .shadings = NULL};
+        array_push(geometry_chunks, new_chunk);
+      }
+      geometry_chunk_t *chunk = &geometry_chunks[num_geometry_chunks++];
+      chunk->mesh_index = mesh_index;
+      chunk->first_face = first_face;
+      chunk->last_face = first_face + FACES_PER_CHUNK < num_faces
+                             ? first_face + FACES_PER_CHUNK
+                             : num_faces;
+    }
+  }
 
-      // Break the clipped polygon apart back into individual triangles
-      triangle_t triangles_after_clipping[MAX_POLY_TRIANGLES];
-      int num_triangles_after_clipping = 0;
+  // Transform every vertex once, then process the faces, each pass in
+  // parallel on the job threads
+  run_jobs(num_vertex_chunks, transform_vertex_chunk, NULL);
+  run_jobs(num_geometry_chunks, process_geometry_chunk, NULL);
 
-      triangles_from_polygon(&polygon, triangles_after_clipping,
-                             &num_triangles_after_clipping);
+  // Last frame's render queue has been drawn: take back its memory
+  arena_reset(&frame_arena);
 
-      // Loop all assembled triangles after clipping
-      for (int t = 0; t < num_triangles_after_clipping; t++) {
-        triangle_t triangle_after_clipping = triangles_after_clipping[t];
+  // Merge the chunk outputs in chunk order, so the triangles end up in the
+  // same mesh/face order as a serial pass (keeps z-fighting deterministic)
+  num_triangles_to_render = 0;
+  for (int c = 0; c < num_geometry_chunks; c++) {
+    num_triangles_to_render += array_length(geometry_chunks[c].positions);
+  }
+  triangle_positions = (triangle_position_t *)arena_alloc(
+      &frame_arena, num_triangles_to_render * sizeof(triangle_position_t));
+  triangle_shadings = (triangle_shading_t *)arena_alloc(
+      &frame_arena, num_triangles_to_render * sizeof(triangle_shading_t));
+
+  int num_merged = 0;
+  for (int c = 0; c < num_geometry_chunks; c++) {
+    geometry_chunk_t *chunk = &geometry_chunks[c];
+    int num_chunk_triangles = array_length(chunk->positions);
+    // save the projected triangles in the arrays of triangles to render
+    if (num_chunk_triangles > 0) {
+      memcpy(&triangle_positions[num_merged], chunk->positions,
+             num_chunk_triangles * sizeof(triangle_position_t));
+      memcpy(&triangle_shadings[num_merged], chunk->shadings,
+             num_chunk_triangles * sizeof(triangle_shading_t));
+      num_merged += num_chunk_triangles;
+    }
+  }
 
-        vec4_t projected_points[3];
+  if (sort_front_to_back) {
+    sort_render_queue();
+  }
+}
 
-        // loop all vertices of triangles NOT excluded by backface culling and
-        // finally project them
-        for (int j = 0; j < 3; j++) {
+/**
+ * Write the depth of triangle index of the render queue inside scissor, for
+ * the depth prepass
+ */
+void render_triangle_depth(int index, rect_t scissor) {
+  draw_triangle_depth(&triangle_positions[index], scissor);
+}
 
-          // project the current vertex (multiply it by the projection matrix)
-          projected_points[j] =
-              mat4_mul_vec4(proj_matrix, triangle_after_clipping.points[j]);
+/**
+ * Draw triangle index of the render queue according to the current render
+ * method, touching only the pixels inside scissor
+ */
+void render_triangle(int index, rect_t scissor) {
+  triangle_position_t *triangle = &triangle_positions[index];
+  triangle_shading_t *shading = &triangle_shadings[index];
+
+  // whole pixel positions of the vertices for the lines and vertex markers
+  int x0 = subpixel_to_pixel(triangle->x[0]);
+  int y0 = subpixel_to_pixel(triangle->y[0]);
+  int x1 = subpixel_to_pixel(triangle->x[1]);
+  int y1 = subpixel_to_pixel(triangle->y[1]);
+  int x2 = subpixel_to_pixel(triangle->x[2]);
+  int y2 = subpixel_to_pixel(triangle->y[2]);
+
+  // if render mode is set to either fill or fill+wireframe...
+  if (should_render_filled_triangles()) {
+    // draw filled triangle
+    draw_filled_triangle(triangle, shading, scissor);
+  }
 
-          // Perform perspective divide
-          if (projected_points[j].w != 0) {
-            projected_points[j].x /= projected_points[j].w;
-            projected_points[j].y /= projected_points[j].w;
-            projected_points[j].z /= projected_points[j].w;
-          }
+  // if render mode is set to either wireframe, wireframe+vertices
+  // fill+wireframe or textured+fireframe...
+  if (should_render_wireframe()) {
+    // draw unfilled triangle
+    draw_triangle(x0, y0, // vertex A
+                  x1, y1, // vertex B
+                  x2, y2, // vertex C
+                  0xFF999999, scissor);
+  }
+  /*
+  // AFFINE MAPPING:
+  // if render mode is set to texture or texture+wireframe...
+  if (should_render_textured_triangles()) {
+      // draw textured triangle
+      draw_textured_triangle(
+          triangle.points[0].x, triangle.points[0].y, triangle.texcoords[0].u,
+  triangle.texcoords[0].v, // vertex A triangle.points[1].x,
+  triangle.points[1].y, triangle.texcoords[1].u, triangle.texcoords[1].v, //
+  vertex B triangle.points[2].x, triangle.points[2].y,
+  triangle.texcoords[2].u, triangle.texcoords[2].v, // vertex C mesh_texture
+      );
 
-          // On-screen y coordinates are processed in the opposite direction in
-          // which they are read in from .obj files, so we will invert y
-          // coordinates here
-          projected_points[j].y *= -1;
+  }
+  */
 
-          // scale into view using window dimensions
-          projected_points[j].x *= (get_window_width() / 2.0);
-          projected_points[j].y *= (get_window_height() / 2.0);
+  // if render mode is set to texture or texture+wireframe...
+  if (should_render_textured_triangles()) {
+    // draw textured triangle
+    draw_textured_triangle(triangle, shading, scissor);
+  }
 
-          // scale and translate the projected points to the middle of screen
-          projected_points[j].x += (get_window_width() / 2.0);
-          projected_points[j].y += (get_window_height() / 2.0);
-        }
+  // if render mode is set to visibility buffer, only store the triangle's
+  // depth and render queue index; it gets textured by the resolve pass
+  if (should_render_visibility_buffer()) {
+    draw_triangle_id(triangle, index, scissor);
+  }
 
-        // Calculate the average depth of each face based on their respective
-        // vertices after transformation
-
-        // Calculate shade intensity based on how aligned the face normal and
-        // light normal are
-        float light_intensity_factor = -vec3_dot(normal, get_light_direction());
-
-        // Calculate triangle color based on light angle
-        uint32_t triangle_color =
-            light_apply_intensity(mesh_face.color, light_intensity_factor);
-
-        // Now using the data we created, we actually create the triangle to
-        // project
-        triangle_t triangle_to_render = {
-            // assign triangle points (taken from the points we just processed
-            // (projected))
-            .points = {{projected_points[0].x, projected_points[0].y,
-                        projected_points[0].z, projected_points[0].w},
-                       {projected_points[1].x, projected_points[1].y,
-                        projected_points[1].z, projected_points[1].w},
-                       {projected_points[2].x, projected_points[2].y,
-                        projected_points[2].z, projected_points[2].w}},
-            /*
-            // AFFINE MAPPING
-            .points = {
-                { projected_points[0].x, projected_points[0].y },
-                { projected_points[1].x, projected_points[1].y },
-                { projected_points[2].x, projected_points[2].y }
-            },*/
-            // assign triangle UV texture coordinates (taken from this object's
-            // mesh's face struct)
-            .texcoords = {{triangle_after_clipping.texcoords[0].u,
-                           triangle_after_clipping.texcoords[0].v},
-                          {triangle_after_clipping.texcoords[1].u,
-                           triangle_after_clipping.texcoords[1].v},
-                          {triangle_after_clipping.texcoords[2].u,
-                           triangle_after_clipping.texcoords[2].v}},
-            // assign this triangle's color
-            .color = triangle_color,
-            .texture = mesh->texture};
-
-        // save the projected triangles in the array of triangles to render
-        if (num_triangles_to_render < MAX_TRIANGLES) {
-          triangles_to_render[num_triangles_to_render++] = triangle_to_render;
-        }
-      }
-    }
+  // if render mode is set to wireframe+vertices, render little rectangles at
+  // each vertex
+  if (should_render_wire_vertex()) {
+    draw_rect_scissored(x0 - 3, y0 - 3, 6, 6, 0xFFFF0000, scissor);
+    draw_rect_scissored(x1 - 3, y1 - 3, 6, 6, 0xFFFF0000, scissor);
+    draw_rect_scissored(x2 - 3, y2 - 3, 6, 6, 0xFFFF0000, scissor);
   }
 }
 
-// TODO : Something in this fct is causing slower performance and choppy-looking
-// edges (compare to course code) fix whatever bug is causing this
+/**
+ * Resolve the visibility buffer inside one screen tile
+ */
+void resolve_tile(rect_t tile) {
+  resolve_visibility(triangle_positions, triangle_shadings, tile);
+}
+
 void render(void) {
 
   // Clear all arrays to get ready for next frame
@@ -424,73 +744,44 @@ void render(void) {
   draw_grid(0x00040404, 0x00020000);
   // draw_horizon();
 
-  // loop all projected points and render them
-  for (int i = 0; i < num_triangles_to_render; i++) {
-    triangle_t triangle = triangles_to_render[i];
-
-    // if render mode is set to either fill or fill+wireframe...
-    if (should_render_filled_triangles()) {
-      // draw filled triangle
-      draw_filled_triangle(
-          triangle.points[0].x, triangle.points[0].y, triangle.points[0].z,
-          triangle.points[0].w, // vertex A
-          triangle.points[1].x, triangle.points[1].y, triangle.points[1].z,
-          triangle.points[1].w, // vertex B
-          triangle.points[2].x, triangle.points[2].y, triangle.points[2].z,
-          triangle.points[2].w, // vertex C
-          triangle.color);
-    }
-
-    // if render mode is set to either wireframe, wireframe+vertices
-    // fill+wireframe or textured+fireframe...
-    if (should_render_wireframe()) {
-      // draw unfilled triangle
-      draw_triangle(triangle.points[0].x, triangle.points[0].y, // vertex A
-                    triangle.points[1].x, triangle.points[1].y, // vertex B
-                    triangle.points[2].x, triangle.points[2].y, // vertex C
-                    0xFF999999);
-    }
-    /*
-    // AFFINE MAPPING:
-    // if render mode is set to texture or texture+wireframe...
-    if (should_render_textured_triangles()) {
-        // draw textured triangle
-        draw_textured_triangle(
-            triangle.points[0].x, triangle.points[0].y, triangle.texcoords[0].u,
-    triangle.texcoords[0].v, // vertex A triangle.points[1].x,
-    triangle.points[1].y, triangle.texcoords[1].u, triangle.texcoords[1].v, //
-    vertex B triangle.points[2].x, triangle.points[2].y,
-    triangle.texcoords[2].u, triangle.texcoords[2].v, // vertex C mesh_texture
-        );
+  if (should_render_visibility_buffer()) {
+    clear_visibility_buffer();
+  }
 
+  // With the depth prepass the filled and textured modes first write the
+  // depth of every triangle, then shade only the pixels whose depth matches
+  bool prepass = z_prepass && (should_render_filled_triangles() ||
+                               should_render_textured_triangles());
+  set_depth_test(prepass ? DEPTH_TEST_EQUAL : DEPTH_TEST_LESS);
+  set_mipmapping(mipmapping);
+  set_texture_filter(should_filter_textures() ? TEXTURE_FILTER_BILINEAR
+                                              : TEXTURE_FILTER_NEAREST);
+
+  // loop all projected points and render them, either screen tile by screen
+  // tile on the worker threads or one triangle at a time on this thread
+  if (get_job_threads() > 1) {
+    render_tiles(triangle_positions, num_triangles_to_render,
+                 prepass ? render_triangle_depth : NULL, render_triangle);
+  } else {
+    rect_t screen = get_screen_rect();
+    if (prepass) {
+      for (int i = 0; i < num_triangles_to_render; i++) {
+        render_triangle_depth(i, screen);
+      }
     }
-    */
-
-    // if render mode is set to texture or texture+wireframe...
-    if (should_render_textured_triangles()) {
-      // draw textured triangle
-      draw_textured_triangle(
-          triangle.points[0].x, triangle.points[0].y, triangle.points[0].z,
-          triangle.points[0].w, triangle.texcoords[0].u,
-          triangle.texcoords[0].v, // vertex A
-          triangle.points[1].x, triangle.points[1].y, triangle.points[1].z,
-          triangle.points[1].w, triangle.texcoords[1].u,
-          triangle.texcoords[1].v, // vertex B
-          triangle.points[2].x, triangle.points[2].y, triangle.points[2].z,
-          triangle.points[2].w, triangle.texcoords[2].u,
-          triangle.texcoords[2].v, // vertex C
-          triangle.texture);
+    for (int i = 0; i < num_triangles_to_render; i++) {
+      render_triangle(i, screen);
     }
+  }
 
-    // if render mode is set to wireframe+vertices, render little rectangles at
-    // each vertex
-    if (should_render_wire_vertex()) {
-      draw_rect(triangle.points[0].x - 3, triangle.points[0].y - 3, 6, 6,
-                0xFFFF0000);
-      draw_rect(triangle.points[1].x - 3, triangle.points[1].y - 3, 6, 6,
-                0xFFFF0000);
-      draw_rect(triangle.points[2].x - 3, triangle.points[2].y - 3, 6, 6,
-                0xFFFF0000);
+  // The visibility buffer now holds the nearest triangle of every pixel:
+  // texture each covered pixel once
+  if (should_render_visibility_buffer()) {
+    if (get_job_threads() > 1) {
+      run_tile_pass(resolve_tile);
+    } else {
+      resolve_visibility(triangle_positions, triangle_shadings,
+                         get_screen_rect());
     }
   }
 
@@ -501,11 +792,45 @@ void render(void) {
 
 // free the memory that was dynamically allocated by program
 void free_resources(void) {
+  for (int i = 0; i < array_length(geometry_chunks); i++) {
+    array_free(geometry_chunks[i].positions);
+    array_free(geometry_chunks[i].shadings);
+  }
+  array_free(geometry_chunks);
+  array_free(vertex_chunks);
+  fprintf(stderr, "Frame arena peak: %zu bytes\n", arena_peak(&frame_arena));
+  arena_free(&frame_arena);
+  destroy_tile_renderer();
+  destroy_jobs();
   free_meshes();
+  free_textures();
   destroy_window();
 }
 
-int main(void) {
+int main(int argc, char *argv[]) {
+  // "--threads N" sets the number of worker threads, defaulting to one per CPU
+  // core. 1 does all the work on the main thread
+  for (int i = 1; i < argc - 1; i++) {
+    if (strcmp(argv[i], "--threads") == 0) {
+      render_threads = atoi(argv[i + 1]);
+    }
+    // "--mesh-layout aos" keeps the packed vertex and face arrays instead of
+    // the default separate streams
+    if (strcmp(argv[i], "--mesh-layout") == 0) {
+      set_mesh_layout(strcmp(argv[i + 1], "aos") == 0 ? MESH_LAYOUT_AOS
+                                                      : MESH_LAYOUT_SOA);
+    }
+    // "--guard-band G" lets triangles reach G half screens out from the
+    // center before they get clipped on x and y
+    if (strcmp(argv[i], "--guard-band") == 0) {
+      set_guard_band(atof(argv[i + 1]));
+    }
+    // "--texture-atlas off" keeps every mesh texture on its own
+    if (strcmp(argv[i], "--texture-atlas") == 0) {
+      texture_atlas = strcmp(argv[i + 1], "off") != 0;
+    }
+  }
+
   // use boolean flag from initialize_window() to set is_running flag
   is_running = initialize_window();
 
@@ -519,7 +844,6 @@ int main(void) {
     render();
   }
 
-  destroy_window();
   free_resources();
 
   return 0;
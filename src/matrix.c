@@ -1,4 +1,5 @@
 #include "matrix.h"
+#include "simd.h"
 #include <math.h>
 
 mat4_t mat4_identity(void) {
@@ -28,6 +29,86 @@ vec4_t mat4_mul_vec4(mat4_t m, vec4_t v) {
   return result;
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// Batched transforms: push a whole stream of points (w = 1) through one
+// matrix. A vec4_t is 4 floats, so both the SSE2 and the AVX2 builds run these
+// on 128-bit registers, one point (or one component of four points) per
+// register. The scalar builds fall back to the same sums as mat4_mul_vec4, in
+// the same order, so every path produces the same bits
+///////////////////////////////////////////////////////////////////////////////
+static vec4_t mat4_mul_point(const mat4_t *m, float x, float y, float z) {
+  vec4_t result;
+  result.x =
+      (m->m[0][0] * x) + (m->m[0][1] * y) + (m->m[0][2] * z) + m->m[0][3];
+  result.y =
+      (m->m[1][0] * x) + (m->m[1][1] * y) + (m->m[1][2] * z) + m->m[1][3];
+  result.z =
+      (m->m[2][0] * x) + (m->m[2][1] * y) + (m->m[2][2] * z) + m->m[2][3];
+  result.w =
+      (m->m[3][0] * x) + (m->m[3][1] * y) + (m->m[3][2] * z) + m->m[3][3];
+  return result;
+}
+
+void mat4_transform_points(const mat4_t *m, const vec3_t *points, vec4_t *out,
+                           int count) {
+#if SIMD_WIDTH > 1
+  // m * p = column0 * p.x + column1 * p.y + column2 * p.z + column3
+  __m128 column0 = _mm_setr_ps(m->m[0][0], m->m[1][0], m->m[2][0], m->m[3][0]);
+  __m128 column1 = _mm_setr_ps(m->m[0][1], m->m[1][1], m->m[2][1], m->m[3][1]);
+  __m128 column2 = _mm_setr_ps(m->m[0][2], m->m[1][2], m->m[2][2], m->m[3][2]);
+  __m128 column3 = _mm_setr_ps(m->m[0][3], m->m[1][3], m->m[2][3], m->m[3][3]);
+  for (int i = 0; i < count; i++) {
+    // vec3_t is only 12 bytes, so broadcast each component instead of doing a
+    // 16 byte load that could read past the end of the array
+    __m128 result = _mm_mul_ps(column0, _mm_set1_ps(points[i].x));
+    result = _mm_add_ps(result, _mm_mul_ps(column1, _mm_set1_ps(points[i].y)));
+    result = _mm_add_ps(result, _mm_mul_ps(column2, _mm_set1_ps(points[i].z)));
+    result = _mm_add_ps(result, column3);
+    _mm_storeu_ps(&out[i].x, result);
+  }
+#else
+  for (int i = 0; i < count; i++) {
+    out[i] = mat4_mul_point(m, points[i].x, points[i].y, points[i].z);
+  }
+#endif
+}
+
+void mat4_transform_points_soa(const mat4_t *m, const float *xs,
+                               const float *ys, const float *zs, vec4_t *out,
+                               int count) {
+  int i = 0;
+#if SIMD_WIDTH > 1
+  __m128 row[4][4];
+  for (int r = 0; r < 4; r++) {
+    for (int c = 0; c < 4; c++) {
+      row[r][c] = _mm_set1_ps(m->m[r][c]);
+    }
+  }
+  // Four points at a time: one register holds the same component of all four
+  // points, then a transpose turns them back into four vec4_t
+  for (; i + 4 <= count; i += 4) {
+    __m128 x = _mm_loadu_ps(&xs[i]);
+    __m128 y = _mm_loadu_ps(&ys[i]);
+    __m128 z = _mm_loadu_ps(&zs[i]);
+    __m128 result[4];
+    for (int r = 0; r < 4; r++) {
+      result[r] = _mm_mul_ps(row[r][0], x);
+      result[r] = _mm_add_ps(result[r], _mm_mul_ps(row[r][1], y));
+      result[r] = _mm_add_ps(result[r], _mm_mul_ps(row[r][2], z));
+      result[r] = _mm_add_ps(result[r], row[r][3]);
+    }
+    _MM_TRANSPOSE4_PS(result[0], result[1], result[2], result[3]);
+    _mm_storeu_ps(&out[i + 0].x, result[0]);
+    _mm_storeu_ps(&out[i + 1].x, result[1]);
+    _mm_storeu_ps(&out[i + 2].x, result[2]);
+    _mm_storeu_ps(&out[i + 3].x, result[3]);
+  }
+#endif
+  for (; i < count; i++) {
+    out[i] = mat4_mul_point(m, xs[i], ys[i], zs[i]);
+  }
+}
+
 mat4_t mat4_make_translation(float tx, float ty, float tz) {
 
   mat4_t matrix = mat4_identity();
@@ -99,6 +180,26 @@ mat4_t mat4_mul_mat4(mat4_t a, mat4_t b) {
   return result;
 }
 
+mat4_t mat4_cofactor3(mat4_t m) {
+  // Each row of the cofactor matrix is the cross product of the other two rows
+  // of m, taken in cyclic order
+  mat4_t result = {{{0}}};
+  for (int i = 0; i < 3; i++) {
+    int r1 = (i + 1) % 3;
+    int r2 = (i + 2) % 3;
+    result.m[i][0] = m.m[r1][1] * m.m[r2][2] - m.m[r1][2] * m.m[r2][1];
+    result.m[i][1] = m.m[r1][2] * m.m[r2][0] - m.m[r1][0] * m.m[r2][2];
+    result.m[i][2] = m.m[r1][0] * m.m[r2][1] - m.m[r1][1] * m.m[r2][0];
+  }
+  return result;
+}
+
+float mat4_determinant3(mat4_t m) {
+  return m.m[0][0] * (m.m[1][1] * m.m[2][2] - m.m[1][2] * m.m[2][1]) +
+         m.m[0][1] * (m.m[1][2] * m.m[2][0] - m.m[1][0] * m.m[2][2]) +
+         m.m[0][2] * (m.m[1][0] * m.m[2][1] - m.m[1][1] * m.m[2][0]);
+}
+
 mat4_t mat4_make_perspective(float fov, float aspect_ratio, float znear,
                              float zfar) {
   // Each scalar expression multiplied in the way we do below normalizes each
@@ -12,6 +12,21 @@ mat4_t mat4_make_scale(float sx, float sy, float sz);
 vec4_t mat4_mul_vec4(mat4_t, vec4_t v);
 mat4_t mat4_mul_mat4(mat4_t a, mat4_t b);
 
+// Transform count points (w = 1) with the same matrix, writing one vec4_t per
+// point to out. The _soa version reads the points from separate x, y and z
+// streams instead of packed vec3_t
+void mat4_transform_points(const mat4_t *m, const vec3_t *points, vec4_t *out,
+                           int count);
+void mat4_transform_points_soa(const mat4_t *m, const float *xs,
+                               const float *ys, const float *zs, vec4_t *out,
+                               int count);
+
+// Cofactor matrix of the upper-left 3x3 of m (the rest is 0). It transforms a
+// cross product of two vectors the same way m transforms the vectors
+// themselves, so it maps object space face normals to camera space ones
+mat4_t mat4_cofactor3(mat4_t m);
+float mat4_determinant3(mat4_t m);
+
 mat4_t mat4_make_translation(float tx, float ty, float tz);
 mat4_t mat4_make_rotation_x(float angle);
 mat4_t mat4_make_rotation_y(float angle);
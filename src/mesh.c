@@ -1,5 +1,7 @@
 #include "mesh.h"
 #include "array.h"
+#include "clipping.h"
+#include <math.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -9,10 +11,14 @@
 #define MAX_NUM_MESHES 10
 static mesh_t meshes[MAX_NUM_MESHES];
 static int mesh_count = 0;
+static int mesh_layout = MESH_LAYOUT_SOA;
+
+void set_mesh_layout(int layout) { mesh_layout = layout; }
 
 void load_mesh(char *obj_filename, char *png_filename, vec3_t scale,
                vec3_t translation, vec3_t rotation) {
 
+  meshes[mesh_count].layout = mesh_layout;
   load_mesh_obj_data(&meshes[mesh_count], obj_filename);
   load_mesh_png_data(&meshes[mesh_count], png_filename);
 
@@ -35,7 +41,13 @@ void load_mesh_obj_data(mesh_t *mesh, char *obj_filename) {
     if (strncmp(line, "v ", 2) == 0) {
       vec3_t vertex;
       sscanf(line, "v %f %f %f", &vertex.x, &vertex.y, &vertex.z);
-      array_push(mesh->vertices, vertex);
+      if (mesh->layout == MESH_LAYOUT_SOA) {
+        array_push(mesh->vertex_x, vertex.x);
+        array_push(mesh->vertex_y, vertex.y);
+        array_push(mesh->vertex_z, vertex.z);
+      } else {
+        array_push(mesh->vertices, vertex);
+      }
     }
     // Texture coordinate information
     if (strncmp(line, "vt ", 3) == 0) {
@@ -52,6 +64,16 @@ void load_mesh_obj_data(mesh_t *mesh, char *obj_filename) {
              &texture_indices[0], &normal_indices[0], &vertex_indices[1],
              &texture_indices[1], &normal_indices[1], &vertex_indices[2],
              &texture_indices[2], &normal_indices[2]);
+      if (mesh->layout == MESH_LAYOUT_SOA) {
+        // faces point into the shared texture coordinates instead of
+        // carrying their own copies
+        for (int j = 0; j < 3; j++) {
+          array_push(mesh->face_vertices, vertex_indices[j] - 1);
+          array_push(mesh->face_texcoords, texture_indices[j] - 1);
+        }
+        array_push(mesh->face_colors, 0xFFFFFFFF);
+        continue;
+      }
       face_t face = {.a = vertex_indices[0],
                      .b = vertex_indices[1],
                      .c = vertex_indices[2],
@@ -62,8 +84,64 @@ void load_mesh_obj_data(mesh_t *mesh, char *obj_filename) {
       array_push(mesh->faces, face);
     }
   }
-  array_free(texcoords);
+  if (mesh->layout == MESH_LAYOUT_SOA) {
+    mesh->texcoords = texcoords;
+  } else {
+    array_free(texcoords);
+  }
   fclose(file);
+
+  // Room for every vertex transformed to clip space, so faces sharing a
+  // vertex can reuse its transform
+  mesh->transformed_vertices =
+      array_hold(NULL, mesh_num_vertices(mesh), sizeof(vec4_t));
+  mesh->vertex_outcodes =
+      array_hold(NULL, mesh_num_vertices(mesh), sizeof(uint16_t));
+
+  // Bounding box of the vertices, and a bounding sphere around its center
+  int num_vertices = mesh_num_vertices(mesh);
+  vec3_t bounds_min =
+      num_vertices > 0 ? mesh_vertex(mesh, 0) : vec3_new(0, 0, 0);
+  vec3_t bounds_max = bounds_min;
+  for (int i = 1; i < num_vertices; i++) {
+    vec3_t vertex = mesh_vertex(mesh, i);
+    bounds_min = vec3_new(fminf(bounds_min.x, vertex.x),
+                          fminf(bounds_min.y, vertex.y),
+                          fminf(bounds_min.z, vertex.z));
+    bounds_max = vec3_new(fmaxf(bounds_max.x, vertex.x),
+                          fmaxf(bounds_max.y, vertex.y),
+                          fmaxf(bounds_max.z, vertex.z));
+  }
+  mesh->bounds_min = bounds_min;
+  mesh->bounds_max = bounds_max;
+  mesh->bounds_center = vec3_mul(vec3_add(bounds_min, bounds_max), 0.5);
+  mesh->bounds_radius = 0;
+  for (int i = 0; i < num_vertices; i++) {
+    float distance =
+        vec3_length(vec3_sub(mesh_vertex(mesh, i), mesh->bounds_center));
+    if (distance > mesh->bounds_radius) {
+      mesh->bounds_radius = distance;
+    }
+  }
+
+  // Precompute the plane of every face in object space (unit normal and
+  // distance from the origin), so culling and lighting need no per-frame cross
+  // products. The normal is built the same way the camera space one used to be
+  int num_faces = mesh_num_faces(mesh);
+  mesh->face_planes = array_hold(NULL, num_faces, sizeof(vec4_t));
+  for (int i = 0; i < num_faces; i++) {
+    vec3_t vector_a = mesh_vertex(mesh, mesh_face_vertex(mesh, i, 0));
+    vec3_t vector_b = mesh_vertex(mesh, mesh_face_vertex(mesh, i, 1));
+    vec3_t vector_c = mesh_vertex(mesh, mesh_face_vertex(mesh, i, 2));
+    vec3_t vector_ab = vec3_sub(vector_b, vector_a);
+    vec3_t vector_ac = vec3_sub(vector_c, vector_a);
+    vec3_normalize(&vector_ab);
+    vec3_normalize(&vector_ac);
+    vec3_t normal = vec3_cross(vector_ab, vector_ac);
+    vec3_normalize(&normal);
+    mesh->face_planes[i] =
+        (vec4_t){normal.x, normal.y, normal.z, vec3_dot(normal, vector_a)};
+  }
 }
 
 void load_mesh_png_data(mesh_t *mesh, char *png_filename) {
@@ -74,6 +152,205 @@ void load_mesh_png_data(mesh_t *mesh, char *png_filename) {
       mesh->texture = png_image;
     }
   }
+  mesh->texture_handle = add_texture(mesh->texture);
+}
+
+/**
+ * Whether every texture coordinate of the mesh lies inside [0, 1]
+ */
+static bool mesh_uvs_in_unit_square(mesh_t *mesh) {
+  int num_faces = mesh_num_faces(mesh);
+  for (int i = 0; i < num_faces; i++) {
+    for (int corner = 0; corner < 3; corner++) {
+      tex2_t uv = mesh_face_uv(mesh, i, corner);
+      if (uv.u < 0 || uv.u > 1 || uv.v < 0 || uv.v > 1) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+/**
+ * Whether every mesh using the texture keeps its UVs inside [0, 1]. Atlas
+ * cells do not wrap, so only such textures can be packed
+ */
+static bool texture_uvs_in_unit_square(int handle) {
+  for (int i = 0; i < mesh_count; i++) {
+    if (meshes[i].texture_handle == handle &&
+        !mesh_uvs_in_unit_square(&meshes[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void pack_mesh_textures(void) {
+  // 1. Collect every texture handle once, even when several meshes share it
+  int *handles = NULL;
+  for (int i = 0; i < mesh_count; i++) {
+    int handle = meshes[i].texture_handle;
+    bool seen = handle < 0;
+    for (int j = 0; j < array_length(handles) && !seen; j++) {
+      seen = handles[j] == handle;
+    }
+    if (!seen) {
+      array_push(handles, handle);
+    }
+  }
+
+  // 2. Keep only the textures that every one of their meshes maps inside the
+  // unit square
+  int num_packable = 0;
+  for (int i = 0; i < array_length(handles); i++) {
+    if (texture_uvs_in_unit_square(handles[i])) {
+      handles[num_packable++] = handles[i];
+    }
+  }
+
+  pack_textures(handles, num_packable);
+  array_free(handles);
+
+  // Move the UVs of the meshes whose texture got packed into its page
+  for (int i = 0; i < mesh_count; i++) {
+    mesh_t *mesh = &meshes[i];
+    if (mesh->texture_handle < 0) {
+      continue;
+    }
+    texture_t *texture = get_texture(mesh->texture_handle);
+    if (texture->atlas_page < 0) {
+      continue;
+    }
+    if (mesh->layout == MESH_LAYOUT_SOA) {
+      for (int j = 0; j < array_length(mesh->texcoords); j++) {
+        mesh->texcoords[j] = atlas_texcoord(texture, mesh->texcoords[j]);
+      }
+    } else {
+      for (int j = 0; j < array_length(mesh->faces); j++) {
+        face_t *face = &mesh->faces[j];
+        face->a_uv = atlas_texcoord(texture, face->a_uv);
+        face->b_uv = atlas_texcoord(texture, face->b_uv);
+        face->c_uv = atlas_texcoord(texture, face->c_uv);
+      }
+    }
+  }
+}
+
+void update_mesh_transform(mesh_t *mesh, mat4_t view_matrix,
+                           mat4_t proj_matrix) {
+  bool world_changed =
+      !mesh->has_transform ||
+      memcmp(&mesh->scale, &mesh->transform_scale, sizeof(vec3_t)) != 0 ||
+      memcmp(&mesh->rotation, &mesh->transform_rotation, sizeof(vec3_t)) !=
+          0 ||
+      memcmp(&mesh->translation, &mesh->transform_translation,
+             sizeof(vec3_t)) != 0;
+  bool view_changed =
+      !mesh->has_transform ||
+      memcmp(&view_matrix, &mesh->transform_view, sizeof(mat4_t)) != 0;
+  bool projection_changed =
+      !mesh->has_transform ||
+      memcmp(&proj_matrix, &mesh->transform_projection, sizeof(mat4_t)) != 0;
+
+  if (world_changed) {
+    // Create a World Matrix combining scale, rotation and translation
+    // matrices Since matrix multiplication is not commutative, order
+    // matters! (scale, rotate, translate)
+    mat4_t world_matrix = mat4_identity();
+    // multiply w_m by scale to store scale scalars within it
+    world_matrix = mat4_mul_mat4(
+        mat4_make_scale(mesh->scale.x, mesh->scale.y, mesh->scale.z),
+        world_matrix);
+    // multiply w_m by rotation matrices to store rotation scalars within it
+    world_matrix =
+        mat4_mul_mat4(mat4_make_rotation_z(mesh->rotation.z), world_matrix);
+    world_matrix =
+        mat4_mul_mat4(mat4_make_rotation_y(mesh->rotation.y), world_matrix);
+    world_matrix =
+        mat4_mul_mat4(mat4_make_rotation_x(mesh->rotation.x), world_matrix);
+    // multiply w_m by translation matrix to store translation scalars
+    // within it
+    world_matrix =
+        mat4_mul_mat4(mat4_make_translation(mesh->translation.x,
+                                            mesh->translation.y,
+                                            mesh->translation.z),
+                      world_matrix);
+
+    mesh->world_matrix = world_matrix;
+    mesh->transform_scale = mesh->scale;
+    mesh->transform_rotation = mesh->rotation;
+    mesh->transform_translation = mesh->translation;
+  }
+
+  if (world_changed || view_changed) {
+    mat4_t model_view = mat4_mul_mat4(view_matrix, mesh->world_matrix);
+    mesh->model_view_matrix = model_view;
+    mesh->transform_view = view_matrix;
+
+    // The camera sits at the camera space origin, so in object space it is at
+    // inverse(model-view) * origin = -transpose(cofactors) * translation / det
+    mat4_t cofactors = mat4_cofactor3(model_view);
+    float determinant = mat4_determinant3(model_view);
+    float object_camera[3];
+    for (int j = 0; j < 3; j++) {
+      object_camera[j] = -(cofactors.m[0][j] * model_view.m[0][3] +
+                           cofactors.m[1][j] * model_view.m[1][3] +
+                           cofactors.m[2][j] * model_view.m[2][3]) /
+                         determinant;
+    }
+    mesh->object_camera =
+        vec3_new(object_camera[0], object_camera[1], object_camera[2]);
+    mesh->normal_matrix = cofactors;
+    // A mirroring transform (negative determinant) flips which side of a face
+    // is its front
+    mesh->handedness = determinant < 0 ? -1 : 1;
+  }
+
+  if (world_changed || view_changed || projection_changed) {
+    mesh->model_view_projection_matrix =
+        mat4_mul_mat4(proj_matrix, mesh->model_view_matrix);
+    mesh->transform_projection = proj_matrix;
+  }
+
+  mesh->has_transform = true;
+}
+
+int classify_mesh_in_frustum(mesh_t *mesh) {
+  mat4_t *model_view = &mesh->model_view_matrix;
+
+  // The model-view matrix only rotates and scales (no shear), so the sphere
+  // stays a sphere whose radius grows by the largest axis scale
+  float max_scale = 0;
+  for (int j = 0; j < 3; j++) {
+    float column_length = sqrt(model_view->m[0][j] * model_view->m[0][j] +
+                               model_view->m[1][j] * model_view->m[1][j] +
+                               model_view->m[2][j] * model_view->m[2][j]);
+    if (column_length > max_scale) {
+      max_scale = column_length;
+    }
+  }
+  vec4_t center;
+  mat4_transform_points(model_view, &mesh->bounds_center, &center, 1);
+  int visibility = classify_sphere_in_frustum(
+      vec3_from_vec4(center), mesh->bounds_radius * max_scale * 1.001);
+
+  // The sphere is loose around long thin meshes: refine with the 8 corners
+  // of the bounding box, in clip space
+  if (visibility == FRUSTUM_INTERSECTING) {
+    vec3_t corners[8];
+    vec4_t clip_corners[8];
+    for (int i = 0; i < 8; i++) {
+      corners[i].x = (i & 1) ? mesh->bounds_max.x : mesh->bounds_min.x;
+      corners[i].y = (i & 2) ? mesh->bounds_max.y : mesh->bounds_min.y;
+      corners[i].z = (i & 4) ? mesh->bounds_max.z : mesh->bounds_min.z;
+    }
+    mat4_transform_points(&mesh->model_view_projection_matrix, corners,
+                          clip_corners, 8);
+    visibility = classify_points_in_frustum(clip_corners, 8);
+  }
+
+  mesh->frustum_visibility = visibility;
+  return visibility;
 }
 
 int get_num_meshes(void) { return mesh_count; }
@@ -85,5 +362,15 @@ void free_meshes(void) {
     upng_free(meshes[i].texture);
     array_free(meshes[i].faces);
     array_free(meshes[i].vertices);
+    array_free(meshes[i].vertex_x);
+    array_free(meshes[i].vertex_y);
+    array_free(meshes[i].vertex_z);
+    array_free(meshes[i].face_vertices);
+    array_free(meshes[i].face_texcoords);
+    array_free(meshes[i].face_colors);
+    array_free(meshes[i].texcoords);
+    array_free(meshes[i].transformed_vertices);
+    array_free(meshes[i].face_planes);
+    array_free(meshes[i].vertex_outcodes);
   }
 }
@@ -2,28 +2,159 @@
 #define MESH_H
 
 // USER-DEFINED INCLUDES
+#include "array.h"
+#include "matrix.h"
 #include "triangle.h"
 #include "upng.h"
 #include "vector.h"
+#include <stdbool.h>
+
+// MESH_LAYOUT_AOS keeps one vec3_t per vertex and one face_t per face.
+// MESH_LAYOUT_SOA splits them into separate streams (x, y and z positions,
+// vertex indices, texture coordinate indices and colors) so passes only touch
+// the data they need, and faces share texture coordinates instead of copying
+// them
+enum mesh_layout { MESH_LAYOUT_AOS, MESH_LAYOUT_SOA };
 
 // define a struct for dynamically sized meshes with arrays of faces and
-// vertices
+// vertices. Read them through the mesh_num_* and mesh_face_* accessors below,
+// which work with either layout
 typedef struct {
-  vec3_t *vertices;   // dynamic array of vertices
-  face_t *faces;      // dynamic array of faces
-  upng_t *texture;    // pointer to mesh PNG texture
-  vec3_t rotation;    // rotation with x, y, and z values
-  vec3_t scale;       // scale with x, y and z values
-  vec3_t translation; // translate with x, y and z values
+  int layout;                   // MESH_LAYOUT_AOS or MESH_LAYOUT_SOA
+  vec3_t *vertices;             // AOS: dynamic array of vertices
+  face_t *faces;                // AOS: dynamic array of faces
+  float *vertex_x;              // SOA: dynamic array of vertex x positions
+  float *vertex_y;              // SOA: dynamic array of vertex y positions
+  float *vertex_z;              // SOA: dynamic array of vertex z positions
+  int *face_vertices;           // SOA: 3 zero-based vertex indices per face
+  int *face_texcoords;          // SOA: 3 zero-based texcoord indices per face
+  uint32_t *face_colors;        // SOA: one color per face
+  tex2_t *texcoords;            // SOA: the texture coordinates of the file
+  vec4_t *transformed_vertices; // clip space vertices, refilled every frame
+  uint16_t *vertex_outcodes;    // clip plane outcodes of transformed_vertices
+  vec4_t *face_planes; // object space unit normal (xyz) and distance (w)
+  vec3_t bounds_min;    // object space bounding box
+  vec3_t bounds_max;
+  vec3_t bounds_center; // object space bounding sphere
+  float bounds_radius;
+  int frustum_visibility; // FRUSTUM_* of the mesh's bounds this frame
+  upng_t *texture;              // pointer to mesh PNG texture
+  int texture_handle;           // texture table handle, -1 without texture
+  vec3_t rotation;              // rotation with x, y, and z values
+  vec3_t scale;                 // scale with x, y and z values
+  vec3_t translation;           // translate with x, y and z values
+
+  // per-object transform, cached between frames (see update_mesh_transform)
+  mat4_t world_matrix;                 // scale, then rotate, then translate
+  mat4_t model_view_matrix;            // world then view
+  mat4_t model_view_projection_matrix; // world, view then projection
+  mat4_t normal_matrix; // object to camera space face normals (cofactors)
+  vec3_t object_camera; // camera position in object space
+  float handedness;     // -1 if model-view mirrors the mesh, 1 otherwise
+  vec3_t transform_scale;              // scale world_matrix was built from
+  vec3_t transform_rotation;           // rotation world_matrix was built from
+  vec3_t transform_translation;  // translation world_matrix was built from
+  mat4_t transform_view;         // view matrix model_view_matrix was built from
+  mat4_t transform_projection;   // projection the MVP matrix was built from
+  bool has_transform;            // false until the matrices are first built
 } mesh_t;
 
+/**
+ * Choose the layout of the meshes loaded from now on (MESH_LAYOUT_SOA unless
+ * set otherwise)
+ */
+void set_mesh_layout(int layout);
+
 void load_mesh(char *obj_filename, char *png_filename, vec3_t scale,
                vec3_t translation, vec3_t rotation);
 void load_mesh_obj_data(mesh_t *mesh, char *obj_filename);
 void load_mesh_png_data(mesh_t *mesh, char *png_filename);
 
+/**
+ * Pack the textures of the loaded meshes into shared atlas pages (see
+ * pack_textures) and move the UVs of the meshes onto the pages. The meshes
+ * keep their texture handles, which now sample from the pages. Textures a
+ * mesh repeats (UVs outside [0, 1]) stay on their own
+ */
+void pack_mesh_textures(void);
+
+/**
+ * Rebuild the mesh's world, model-view and model-view-projection matrices,
+ * but only the ones whose inputs (scale/rotation/translation, camera or
+ * projection) changed since the last call
+ */
+void update_mesh_transform(mesh_t *mesh, mat4_t view_matrix,
+                           mat4_t proj_matrix);
+
+/**
+ * Test the mesh's bounding sphere, then if that is inconclusive its bounding
+ * box, against the view frustum using the current model-view matrix. Stores
+ * and returns FRUSTUM_OUTSIDE, FRUSTUM_INTERSECTING or FRUSTUM_INSIDE
+ */
+int classify_mesh_in_frustum(mesh_t *mesh);
+
 int get_num_meshes(void);
 mesh_t *get_mesh(int index);
 
 void free_meshes(void);
+
+///////////////////////////////////////////////////////////////////////////////
+// Layout independent accessors, inline since the geometry stage calls them
+// for every face. Vertex and texcoord indices are zero-based
+///////////////////////////////////////////////////////////////////////////////
+static inline int mesh_num_vertices(mesh_t *mesh) {
+  return mesh->layout == MESH_LAYOUT_SOA ? array_length(mesh->vertex_x)
+                                         : array_length(mesh->vertices);
+}
+
+static inline int mesh_num_faces(mesh_t *mesh) {
+  return mesh->layout == MESH_LAYOUT_SOA ? array_length(mesh->face_colors)
+                                         : array_length(mesh->faces);
+}
+
+static inline vec3_t mesh_vertex(mesh_t *mesh, int index) {
+  if (mesh->layout == MESH_LAYOUT_SOA) {
+    return vec3_new(mesh->vertex_x[index], mesh->vertex_y[index],
+                    mesh->vertex_z[index]);
+  }
+  return mesh->vertices[index];
+}
+
+// index of the vertex at corner 0, 1 or 2 of a face
+static inline int mesh_face_vertex(mesh_t *mesh, int face, int corner) {
+  if (mesh->layout == MESH_LAYOUT_SOA) {
+    return mesh->face_vertices[face * 3 + corner];
+  }
+  face_t *f = &mesh->faces[face];
+  return (corner == 0 ? f->a : corner == 1 ? f->b : f->c) - 1;
+}
+
+// texture coordinate at corner 0, 1 or 2 of a face
+static inline tex2_t mesh_face_uv(mesh_t *mesh, int face, int corner) {
+  if (mesh->layout == MESH_LAYOUT_SOA) {
+    return mesh->texcoords[mesh->face_texcoords[face * 3 + corner]];
+  }
+  face_t *f = &mesh->faces[face];
+  return corner == 0 ? f->a_uv : corner == 1 ? f->b_uv : f->c_uv;
+}
+
+static inline uint32_t mesh_face_color(mesh_t *mesh, int face) {
+  return mesh->layout == MESH_LAYOUT_SOA ? mesh->face_colors[face]
+                                         : mesh->faces[face].color;
+}
+
+/**
+ * Transform vertices [first, first + count) of the mesh with matrix m into
+ * out, using the batched transform that matches the mesh's layout
+ */
+static inline void mesh_transform_vertices(mesh_t *mesh, const mat4_t *m,
+                                           int first, int count, vec4_t *out) {
+  if (mesh->layout == MESH_LAYOUT_SOA) {
+    mat4_transform_points_soa(m, &mesh->vertex_x[first],
+                              &mesh->vertex_y[first], &mesh->vertex_z[first],
+                              out, count);
+  } else {
+    mat4_transform_points(m, &mesh->vertices[first], out, count);
+  }
+}
 #endif
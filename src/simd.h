@@ -0,0 +1,274 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <stdint.h>
+
+///////////////////////////////////////////////////////////////////////////////
+// Thin wrappers over SSE2 (4 lanes) and AVX2 (8 lanes) intrinsics so the
+// rasterizer kernels can be written once for both widths. The widest
+// instruction set enabled at compile time wins (build with -mavx2 or
+// -march=native for AVX2). When neither is available SIMD_WIDTH is 1 and
+// callers fall back to their scalar per-pixel path.
+//
+// Comparisons return lane masks as simd_int with all bits set for true lanes
+///////////////////////////////////////////////////////////////////////////////
+
+#if defined(__AVX2__)
+
+#include <immintrin.h>
+
+#define SIMD_WIDTH 8
+
+typedef __m256 simd_float;
+typedef __m256i simd_int;
+
+static inline simd_float simd_set1_f(float a) { return _mm256_set1_ps(a); }
+static inline simd_int simd_set1_i(int a) { return _mm256_set1_epi32(a); }
+
+// base + lane * step for every lane
+static inline simd_int simd_ramp_i(int base, int step) {
+  return _mm256_setr_epi32(base, base + step, base + 2 * step,
+                           base + 3 * step, base + 4 * step, base + 5 * step,
+                           base + 6 * step, base + 7 * step);
+}
+
+static inline simd_float simd_add_f(simd_float a, simd_float b) {
+  return _mm256_add_ps(a, b);
+}
+static inline simd_float simd_sub_f(simd_float a, simd_float b) {
+  return _mm256_sub_ps(a, b);
+}
+static inline simd_float simd_mul_f(simd_float a, simd_float b) {
+  return _mm256_mul_ps(a, b);
+}
+static inline simd_float simd_div_f(simd_float a, simd_float b) {
+  return _mm256_div_ps(a, b);
+}
+
+static inline simd_int simd_add_i(simd_int a, simd_int b) {
+  return _mm256_add_epi32(a, b);
+}
+static inline simd_int simd_sub_i(simd_int a, simd_int b) {
+  return _mm256_sub_epi32(a, b);
+}
+static inline simd_int simd_and_i(simd_int a, simd_int b) {
+  return _mm256_and_si256(a, b);
+}
+static inline simd_int simd_or_i(simd_int a, simd_int b) {
+  return _mm256_or_si256(a, b);
+}
+static inline simd_int simd_min_i(simd_int a, simd_int b) {
+  return _mm256_min_epi32(a, b);
+}
+static inline simd_int simd_max_i(simd_int a, simd_int b) {
+  return _mm256_max_epi32(a, b);
+}
+// logical shifts of every lane by the same number of bits
+static inline simd_int simd_slli_i(simd_int a, int bits) {
+  return _mm256_slli_epi32(a, bits);
+}
+static inline simd_int simd_srli_i(simd_int a, int bits) {
+  return _mm256_srli_epi32(a, bits);
+}
+static inline simd_int simd_srai_i(simd_int a, int bits) {
+  return _mm256_srai_epi32(a, bits);
+}
+// multiply the 16-bit halves of every lane separately, keeping the low 16 bits
+static inline simd_int simd_mullo_i16(simd_int a, simd_int b) {
+  return _mm256_mullo_epi16(a, b);
+}
+
+static inline simd_int simd_cmpgt_i(simd_int a, simd_int b) {
+  return _mm256_cmpgt_epi32(a, b);
+}
+static inline simd_int simd_cmpeq_i(simd_int a, simd_int b) {
+  return _mm256_cmpeq_epi32(a, b);
+}
+static inline simd_int simd_cmplt_f(simd_float a, simd_float b) {
+  return _mm256_castps_si256(_mm256_cmp_ps(a, b, _CMP_LT_OQ));
+}
+static inline simd_int simd_cmpeq_f(simd_float a, simd_float b) {
+  return _mm256_castps_si256(_mm256_cmp_ps(a, b, _CMP_EQ_OQ));
+}
+
+static inline simd_float simd_cvt_i2f(simd_int a) {
+  return _mm256_cvtepi32_ps(a);
+}
+// float to int, rounding down like floorf
+static inline simd_int simd_floor_f2i(simd_float a) {
+  return _mm256_cvttps_epi32(_mm256_floor_ps(a));
+}
+
+static inline simd_float simd_load_f(const float *p) {
+  return _mm256_loadu_ps(p);
+}
+static inline simd_int simd_load_i(const void *p) {
+  return _mm256_loadu_si256((const __m256i *)p);
+}
+static inline void simd_store_f(float *p, simd_float a) {
+  _mm256_storeu_ps(p, a);
+}
+static inline void simd_store_i(void *p, simd_int a) {
+  _mm256_storeu_si256((__m256i *)p, a);
+}
+
+// Write only the lanes of a whose mask is set, leaving the others in memory
+// untouched
+static inline void simd_maskstore_f(float *p, simd_int mask, simd_float a) {
+  _mm256_maskstore_ps(p, mask, a);
+}
+static inline void simd_maskstore_i(void *p, simd_int mask, simd_int a) {
+  _mm256_maskstore_epi32((int *)p, mask, a);
+}
+
+// Fetch base[index] for every lane whose mask is set (0 elsewhere)
+static inline simd_int simd_gather_i(const uint32_t *base, simd_int index,
+                                     simd_int mask) {
+  return _mm256_mask_i32gather_epi32(_mm256_setzero_si256(), (const int *)base,
+                                     index, mask, 4);
+}
+
+// One bit per lane, set when the lane's mask is set
+static inline int simd_movemask(simd_int mask) {
+  return _mm256_movemask_ps(_mm256_castsi256_ps(mask));
+}
+
+#elif defined(__SSE2__)
+
+#include <emmintrin.h>
+
+#define SIMD_WIDTH 4
+
+typedef __m128 simd_float;
+typedef __m128i simd_int;
+
+static inline simd_float simd_set1_f(float a) { return _mm_set1_ps(a); }
+static inline simd_int simd_set1_i(int a) { return _mm_set1_epi32(a); }
+
+// base + lane * step for every lane
+static inline simd_int simd_ramp_i(int base, int step) {
+  return _mm_setr_epi32(base, base + step, base + 2 * step, base + 3 * step);
+}
+
+static inline simd_float simd_add_f(simd_float a, simd_float b) {
+  return _mm_add_ps(a, b);
+}
+static inline simd_float simd_sub_f(simd_float a, simd_float b) {
+  return _mm_sub_ps(a, b);
+}
+static inline simd_float simd_mul_f(simd_float a, simd_float b) {
+  return _mm_mul_ps(a, b);
+}
+static inline simd_float simd_div_f(simd_float a, simd_float b) {
+  return _mm_div_ps(a, b);
+}
+
+static inline simd_int simd_add_i(simd_int a, simd_int b) {
+  return _mm_add_epi32(a, b);
+}
+static inline simd_int simd_sub_i(simd_int a, simd_int b) {
+  return _mm_sub_epi32(a, b);
+}
+static inline simd_int simd_and_i(simd_int a, simd_int b) {
+  return _mm_and_si128(a, b);
+}
+static inline simd_int simd_or_i(simd_int a, simd_int b) {
+  return _mm_or_si128(a, b);
+}
+// SSE2 has no 32-bit integer min and max: pick lanes with a comparison mask
+static inline simd_int simd_min_i(simd_int a, simd_int b) {
+  simd_int a_greater = _mm_cmpgt_epi32(a, b);
+  return _mm_or_si128(_mm_and_si128(a_greater, b),
+                      _mm_andnot_si128(a_greater, a));
+}
+static inline simd_int simd_max_i(simd_int a, simd_int b) {
+  simd_int a_greater = _mm_cmpgt_epi32(a, b);
+  return _mm_or_si128(_mm_and_si128(a_greater, a),
+                      _mm_andnot_si128(a_greater, b));
+}
+// logical shifts of every lane by the same number of bits
+static inline simd_int simd_slli_i(simd_int a, int bits) {
+  return _mm_slli_epi32(a, bits);
+}
+static inline simd_int simd_srli_i(simd_int a, int bits) {
+  return _mm_srli_epi32(a, bits);
+}
+static inline simd_int simd_srai_i(simd_int a, int bits) {
+  return _mm_srai_epi32(a, bits);
+}
+// multiply the 16-bit halves of every lane separately, keeping the low 16 bits
+static inline simd_int simd_mullo_i16(simd_int a, simd_int b) {
+  return _mm_mullo_epi16(a, b);
+}
+
+static inline simd_int simd_cmpgt_i(simd_int a, simd_int b) {
+  return _mm_cmpgt_epi32(a, b);
+}
+static inline simd_int simd_cmpeq_i(simd_int a, simd_int b) {
+  return _mm_cmpeq_epi32(a, b);
+}
+static inline simd_int simd_cmplt_f(simd_float a, simd_float b) {
+  return _mm_castps_si128(_mm_cmplt_ps(a, b));
+}
+static inline simd_int simd_cmpeq_f(simd_float a, simd_float b) {
+  return _mm_castps_si128(_mm_cmpeq_ps(a, b));
+}
+
+static inline simd_float simd_cvt_i2f(simd_int a) { return _mm_cvtepi32_ps(a); }
+// float to int, rounding down like floorf. SSE2 only truncates, so the lanes
+// where that rounded up (negative values with a fraction) add their compare
+// mask, which is -1
+static inline simd_int simd_floor_f2i(simd_float a) {
+  simd_int truncated = _mm_cvttps_epi32(a);
+  simd_int rounded_up = simd_cmplt_f(a, _mm_cvtepi32_ps(truncated));
+  return _mm_add_epi32(truncated, rounded_up);
+}
+
+static inline simd_float simd_load_f(const float *p) { return _mm_loadu_ps(p); }
+static inline simd_int simd_load_i(const void *p) {
+  return _mm_loadu_si128((const __m128i *)p);
+}
+static inline void simd_store_f(float *p, simd_float a) { _mm_storeu_ps(p, a); }
+static inline void simd_store_i(void *p, simd_int a) {
+  _mm_storeu_si128((__m128i *)p, a);
+}
+
+// SSE2 has no cheap masked store: blend with what is already in memory and
+// write the whole vector back. Callers only use this on blocks they own
+static inline void simd_maskstore_i(void *p, simd_int mask, simd_int a) {
+  simd_int old = _mm_loadu_si128((const __m128i *)p);
+  simd_int blended =
+      _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, old));
+  _mm_storeu_si128((__m128i *)p, blended);
+}
+static inline void simd_maskstore_f(float *p, simd_int mask, simd_float a) {
+  simd_maskstore_i(p, mask, _mm_castps_si128(a));
+}
+
+// Fetch base[index] for every lane whose mask is set (0 elsewhere)
+static inline simd_int simd_gather_i(const uint32_t *base, simd_int index,
+                                     simd_int mask) {
+  int lanes[4];
+  uint32_t result[4] = {0};
+  int bits = _mm_movemask_ps(_mm_castsi128_ps(mask));
+  _mm_storeu_si128((__m128i *)lanes, index);
+  for (int i = 0; i < 4; i++) {
+    if (bits & (1 << i)) {
+      result[i] = base[lanes[i]];
+    }
+  }
+  return _mm_loadu_si128((const __m128i *)result);
+}
+
+// One bit per lane, set when the lane's mask is set
+static inline int simd_movemask(simd_int mask) {
+  return _mm_movemask_ps(_mm_castsi128_ps(mask));
+}
+
+#else
+
+#define SIMD_WIDTH 1
+
+#endif
+
+#endif
@@ -0,0 +1,57 @@
+#include "sort.h"
+#include <string.h>
+
+#define RADIX_BITS 8
+#define RADIX_SIZE (1 << RADIX_BITS)
+#define RADIX_PASSES (32 / RADIX_BITS)
+
+void radix_sort(uint32_t *keys, int *values, uint32_t *key_scratch,
+                int *value_scratch, int n) {
+  // Count the digits of every pass in a single read of the keys
+  int counts[RADIX_PASSES][RADIX_SIZE];
+  memset(counts, 0, sizeof(counts));
+  for (int i = 0; i < n; i++) {
+    for (int pass = 0; pass < RADIX_PASSES; pass++) {
+      counts[pass][(keys[i] >> (pass * RADIX_BITS)) & (RADIX_SIZE - 1)]++;
+    }
+  }
+
+  uint32_t *src_keys = keys, *dst_keys = key_scratch;
+  int *src_values = values, *dst_values = value_scratch;
+  for (int pass = 0; pass < RADIX_PASSES; pass++) {
+    int shift = pass * RADIX_BITS;
+
+    // A digit shared by every key would not change the order: skip the pass
+    if (n == 0 ||
+        counts[pass][(src_keys[0] >> shift) & (RADIX_SIZE - 1)] == n) {
+      continue;
+    }
+
+    // Turn the digit counts into the first output position of every digit
+    int offsets[RADIX_SIZE];
+    int offset = 0;
+    for (int digit = 0; digit < RADIX_SIZE; digit++) {
+      offsets[digit] = offset;
+      offset += counts[pass][digit];
+    }
+
+    for (int i = 0; i < n; i++) {
+      int position = offsets[(src_keys[i] >> shift) & (RADIX_SIZE - 1)]++;
+      dst_keys[position] = src_keys[i];
+      dst_values[position] = src_values[i];
+    }
+
+    uint32_t *swap_keys = src_keys;
+    src_keys = dst_keys;
+    dst_keys = swap_keys;
+    int *swap_values = src_values;
+    src_values = dst_values;
+    dst_values = swap_values;
+  }
+
+  // After an odd number of passes the result is in the scratch arrays
+  if (src_keys != keys) {
+    memcpy(keys, src_keys, n * sizeof(uint32_t));
+    memcpy(values, src_values, n * sizeof(int));
+  }
+}
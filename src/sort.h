@@ -0,0 +1,15 @@
+#ifndef SORT_H
+#define SORT_H
+
+#include <stdint.h>
+
+/**
+ * Sort n (key, value) pairs by ascending key with a least significant digit
+ * radix sort, 8 bits per pass. The sort is stable, so pairs with equal keys
+ * keep their order. keys and values are sorted in place, key_scratch and
+ * value_scratch must have room for n elements each
+ */
+void radix_sort(uint32_t *keys, int *values, uint32_t *key_scratch,
+                int *value_scratch, int n);
+
+#endif
@@ -1,6 +1,375 @@
 #include "texture.h"
+#include "array.h"
+#include <limits.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+// dynamic array of every texture in use, indexed by handle
+static texture_t *textures = NULL;
 
 tex2_t tex2_clone(tex2_t *t) {
   tex2_t result = {t->u, t->v};
   return result;
 }
+
+static int log2_ceil(int n) {
+  int log = 0;
+  while ((1 << log) < n) {
+    log++;
+  }
+  return log;
+}
+
+/**
+ * Allocate a mip level of 2^width_log x 2^height_log texels, padded to whole
+ * tiles
+ */
+static mip_level_t alloc_mip_level(int width_log, int height_log) {
+  mip_level_t level;
+  level.width = 1 << width_log;
+  level.height = 1 << height_log;
+  level.width_mask = level.width - 1;
+  level.height_mask = level.height - 1;
+  level.scale_u = level.width;
+  level.scale_v = level.height;
+
+  int tiles_x_log =
+      width_log > TEXTURE_TILE_BITS ? width_log - TEXTURE_TILE_BITS : 0;
+  int tiles_y = (level.height + TEXTURE_TILE_SIZE - 1) / TEXTURE_TILE_SIZE;
+  level.tile_row_shift = tiles_x_log + 2 * TEXTURE_TILE_BITS;
+  level.buffer = (uint32_t *)calloc((size_t)tiles_y << level.tile_row_shift,
+                                    sizeof(uint32_t));
+  return level;
+}
+
+static uint32_t *texel_at(mip_level_t *level, int x, int y) {
+  return &level->buffer[texel_address(x, y, level->tile_row_shift)];
+}
+
+/**
+ * Channel of a PNG pixel starting at bit offset bit of the decoded buffer,
+ * scaled to 8 bits. Samples are big endian and packed without padding, so
+ * 16-bit channels keep their high byte
+ */
+static uint8_t read_png_channel(const unsigned char *buffer, size_t bit,
+                                int depth) {
+  if (depth >= 8) {
+    return buffer[bit / 8];
+  }
+  int max = (1 << depth) - 1;
+  int value = (buffer[bit / 8] >> (8 - depth - bit % 8)) & max;
+  return value * 255 / max;
+}
+
+/**
+ * Pixel (x,y) of a decoded PNG of any format, converted to the RGBA32 layout
+ * of the color buffer (bytes R, G, B, A in memory)
+ */
+static uint32_t read_png_pixel(upng_t *png, int x, int y) {
+  const unsigned char *buffer = upng_get_buffer(png);
+  int depth = upng_get_bitdepth(png);
+  int components = upng_get_components(png);
+  size_t bit = ((size_t)upng_get_width(png) * y + x) * upng_get_bpp(png);
+
+  uint8_t channels[4] = {0};
+  for (int i = 0; i < components; i++) {
+    channels[i] = read_png_channel(buffer, bit + (size_t)i * depth, depth);
+  }
+
+  // luminance (+ alpha) to grey, and opaque when there is no alpha
+  uint8_t rgba[4];
+  if (components <= 2) {
+    rgba[0] = rgba[1] = rgba[2] = channels[0];
+    rgba[3] = components == 2 ? channels[1] : 255;
+  } else {
+    memcpy(rgba, channels, 3);
+    rgba[3] = components == 4 ? channels[3] : 255;
+  }
+
+  uint32_t texel;
+  memcpy(&texel, rgba, sizeof(texel));
+  return texel;
+}
+
+/**
+ * Convert the pixels of a decoded PNG into the tiled top mip level. Sizes that
+ * are not powers of two are scaled up to the next one (nearest texel), so
+ * wrapping stays a mask and the UVs still cover the whole image once
+ */
+static mip_level_t make_base_level(upng_t *png, int width, int height) {
+  mip_level_t level = alloc_mip_level(log2_ceil(width), log2_ceil(height));
+  for (int y = 0; y < level.height; y++) {
+    int png_y = (int)((int64_t)y * height / level.height);
+    for (int x = 0; x < level.width; x++) {
+      int png_x = (int)((int64_t)x * width / level.width);
+      *texel_at(&level, x, y) = read_png_pixel(png, png_x, png_y);
+    }
+  }
+  return level;
+}
+
+/**
+ * Build the mip level below source: every texel is the average of the 2x2
+ * texels it covers, channel by channel. A side that is already 1 texel long
+ * stays 1 texel long
+ */
+static mip_level_t make_mip_level(mip_level_t *source) {
+  int width_log = log2_ceil(source->width);
+  int height_log = log2_ceil(source->height);
+  mip_level_t level = alloc_mip_level(width_log > 0 ? width_log - 1 : 0,
+                                      height_log > 0 ? height_log - 1 : 0);
+
+  for (int y = 0; y < level.height; y++) {
+    int y0 = 2 * y;
+    int y1 = source->height > 1 ? y0 + 1 : y0;
+    for (int x = 0; x < level.width; x++) {
+      int x0 = 2 * x;
+      int x1 = source->width > 1 ? x0 + 1 : x0;
+      uint32_t texels[4] = {*texel_at(source, x0, y0),
+                            *texel_at(source, x1, y0),
+                            *texel_at(source, x0, y1),
+                            *texel_at(source, x1, y1)};
+
+      uint32_t texel = 0;
+      for (int shift = 0; shift < 32; shift += 8) {
+        uint32_t sum = 2; // round to nearest
+        for (int i = 0; i < 4; i++) {
+          sum += (texels[i] >> shift) & 0xFF;
+        }
+        texel |= (sum / 4) << shift;
+      }
+      *texel_at(&level, x, y) = texel;
+    }
+  }
+  return level;
+}
+
+/**
+ * Build the mip pyramid of a texture below its level 0, down to a single
+ * texel or to max_levels levels
+ */
+static void build_mip_levels(texture_t *texture, int max_levels) {
+  texture->num_levels = 1;
+  while (texture->num_levels < max_levels) {
+    mip_level_t *last = &texture->levels[texture->num_levels - 1];
+    if (last->width == 1 && last->height == 1) {
+      break;
+    }
+    texture->levels[texture->num_levels++] = make_mip_level(last);
+  }
+}
+
+/**
+ * Let every level of texture be sampled anywhere, wrapping around
+ */
+static void set_unbounded_cells(texture_t *texture) {
+  texel_rect_t unbounded = {INT_MIN, INT_MIN, INT_MAX, INT_MAX};
+  for (int level = 0; level < MAX_MIP_LEVELS; level++) {
+    texture->cells[level] = unbounded;
+  }
+}
+
+int add_texture(upng_t *png) {
+  if (png == NULL || upng_get_format(png) == UPNG_BADFORMAT) {
+    return -1;
+  }
+  texture_t texture = {.width = upng_get_width(png),
+                       .height = upng_get_height(png),
+                       .png = png,
+                       .atlas_page = -1};
+
+  // Build the mip pyramid once, down to a single texel
+  texture.levels[0] = make_base_level(png, texture.width, texture.height);
+  build_mip_levels(&texture, MAX_MIP_LEVELS);
+  set_unbounded_cells(&texture);
+
+  array_push(textures, texture);
+  return array_length(textures) - 1;
+}
+
+texture_t *get_texture(int handle) { return &textures[handle]; }
+
+int get_texture_page(int handle) {
+  if (handle < 0 || textures[handle].atlas_page < 0) {
+    return handle;
+  }
+  return textures[handle].atlas_page;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Texture atlases
+///////////////////////////////////////////////////////////////////////////////
+// Every packed texture gets a square cell of a power of two size in a page.
+// Cells are laid out from the largest to the smallest along a Morton (Z-order)
+// curve, so each one starts on a multiple of its own size and they fill the
+// page without gaps. The cells then stay aligned in the mip levels of the page
+// down to the size of the smallest texture, where the page's pyramid stops so
+// that no texel ever mixes two textures.
+///////////////////////////////////////////////////////////////////////////////
+typedef struct {
+  int handle;
+  int size_log; // log2 of the cell size
+} atlas_entry_t;
+
+static int compare_atlas_entries(const void *a, const void *b) {
+  const atlas_entry_t *entry_a = a;
+  const atlas_entry_t *entry_b = b;
+  if (entry_a->size_log != entry_b->size_log) {
+    return entry_b->size_log - entry_a->size_log;
+  }
+  return entry_a->handle - entry_b->handle;
+}
+
+/**
+ * Position of cell index along the Morton curve, in cells: the even bits of
+ * the index make up x, the odd bits y
+ */
+static void morton_decode(int index, int *x, int *y) {
+  *x = 0;
+  *y = 0;
+  for (int bit = 0; bit < 15; bit++) {
+    *x |= ((index >> (2 * bit)) & 1) << bit;
+    *y |= ((index >> (2 * bit + 1)) & 1) << bit;
+  }
+}
+
+/**
+ * Copy the textures of entries into a new atlas page with room for area
+ * texels, and point them at it
+ */
+static void make_atlas_page(atlas_entry_t *entries, int count, int64_t area) {
+  int side_log = 0;
+  while (((int64_t)1 << (2 * side_log)) < area) {
+    side_log++;
+  }
+  texture_t page = {.width = 1 << side_log,
+                    .height = 1 << side_log,
+                    .png = NULL,
+                    .atlas_page = -1};
+  page.levels[0] = alloc_mip_level(side_log, side_log);
+  set_unbounded_cells(&page);
+  int page_handle = array_length(textures);
+  float page_size = page.width;
+
+  int64_t offset = 0;
+  int min_size_log = side_log;
+  for (int i = 0; i < count; i++) {
+    texture_t *texture = &textures[entries[i].handle];
+    mip_level_t *source = &texture->levels[0];
+    int cell_area_log = 2 * entries[i].size_log;
+    int cell_x, cell_y;
+    morton_decode((int)(offset >> cell_area_log), &cell_x, &cell_y);
+    cell_x <<= entries[i].size_log;
+    cell_y <<= entries[i].size_log;
+    offset += (int64_t)1 << cell_area_log;
+
+    for (int y = 0; y < source->height; y++) {
+      for (int x = 0; x < source->width; x++) {
+        *texel_at(&page.levels[0], cell_x + x, cell_y + y) =
+            *texel_at(source, x, y);
+      }
+    }
+
+    texture->atlas_page = page_handle;
+    texture->atlas_offset = (tex2_t){cell_x / page_size, cell_y / page_size};
+    texture->atlas_scale =
+        (tex2_t){source->width / page_size, source->height / page_size};
+    texture->cells[0] =
+        (texel_rect_t){cell_x, cell_y, cell_x + source->width - 1,
+                       cell_y + source->height - 1};
+
+    int width_log = log2_ceil(source->width);
+    int height_log = log2_ceil(source->height);
+    int texture_min_log = width_log < height_log ? width_log : height_log;
+    if (texture_min_log < min_size_log) {
+      min_size_log = texture_min_log;
+    }
+
+    // The page replaces the texture's own pyramid
+    for (int level = 0; level < texture->num_levels; level++) {
+      free(texture->levels[level].buffer);
+    }
+  }
+
+  // Down to the level where the smallest texture is a single texel, the cells
+  // stay whole texels of every level: halve them along with the page
+  build_mip_levels(&page, min_size_log + 1);
+  for (int i = 0; i < count; i++) {
+    texture_t *texture = &textures[entries[i].handle];
+    texel_rect_t cell = texture->cells[0];
+    texture->num_levels = page.num_levels;
+    for (int level = 0; level < page.num_levels; level++) {
+      texture->levels[level] = page.levels[level];
+      texture->cells[level] = (texel_rect_t){
+          cell.min_x >> level, cell.min_y >> level,
+          ((cell.max_x + 1) >> level) - 1, ((cell.max_y + 1) >> level) - 1};
+    }
+  }
+  array_push(textures, page);
+}
+
+void pack_textures(int *handles, int count) {
+  atlas_entry_t *entries =
+      (atlas_entry_t *)malloc(sizeof(atlas_entry_t) * (count > 0 ? count : 1));
+  int num_entries = 0;
+  for (int i = 0; i < count; i++) {
+    texture_t *texture = &textures[handles[i]];
+    mip_level_t *level = &texture->levels[0];
+    if (texture->atlas_page >= 0 || texture->num_levels == 0 ||
+        level->width < ATLAS_MIN_TEXTURE_SIZE ||
+        level->height < ATLAS_MIN_TEXTURE_SIZE ||
+        level->width > ATLAS_MAX_TEXTURE_SIZE ||
+        level->height > ATLAS_MAX_TEXTURE_SIZE) {
+      continue;
+    }
+    int width_log = log2_ceil(level->width);
+    int height_log = log2_ceil(level->height);
+    entries[num_entries].handle = handles[i];
+    entries[num_entries].size_log =
+        width_log > height_log ? width_log : height_log;
+    num_entries++;
+  }
+  qsort(entries, num_entries, sizeof(atlas_entry_t), compare_atlas_entries);
+
+  // Fill pages with the sorted cells until the next one does not fit
+  int64_t page_area = (int64_t)ATLAS_PAGE_SIZE * ATLAS_PAGE_SIZE;
+  int first = 0;
+  while (first < num_entries) {
+    int64_t area = 0;
+    int last = first;
+    while (last < num_entries &&
+           area + ((int64_t)1 << (2 * entries[last].size_log)) <= page_area) {
+      area += (int64_t)1 << (2 * entries[last].size_log);
+      last++;
+    }
+    if (last - first > 1) {
+      make_atlas_page(&entries[first], last - first, area);
+    }
+    first = last > first ? last : first + 1;
+  }
+  free(entries);
+}
+
+tex2_t atlas_texcoord(texture_t *texture, tex2_t uv) {
+  // The page is placed in the flipped (downwards) v the rasterizer samples
+  // with, so flip v, map it and flip it back
+  float v = texture->atlas_offset.v + (1 - uv.v) * texture->atlas_scale.v;
+  tex2_t result = {texture->atlas_offset.u + uv.u * texture->atlas_scale.u,
+                   1 - v};
+  return result;
+}
+
+void free_textures(void) {
+  for (int i = 0; i < array_length(textures); i++) {
+    // the levels of packed textures belong to their page
+    if (textures[i].atlas_page >= 0) {
+      continue;
+    }
+    for (int level = 0; level < textures[i].num_levels; level++) {
+      free(textures[i].levels[level].buffer);
+    }
+  }
+  array_free(textures);
+  textures = NULL;
+}
@@ -1,11 +1,118 @@
 #ifndef TEXTURE_H
 #define TEXTURE_H
 
+#include "upng.h"
+#include <stdint.h>
+
 typedef struct {
   float u;
   float v;
 } tex2_t;
 
+// Enough levels for a 32768 x 32768 texture
+#define MAX_MIP_LEVELS 16
+
+// Texels are stored in square tiles of TEXTURE_TILE_SIZE x TEXTURE_TILE_SIZE
+// texels (64 bytes, one cache line), the tiles and the texels inside each tile
+// in row-major order. Neighbouring texels then share a cache line whichever
+// direction a triangle walks the texture in
+#define TEXTURE_TILE_BITS 2
+#define TEXTURE_TILE_SIZE (1 << TEXTURE_TILE_BITS)
+
+// One level of the mip pyramid of a texture. Sizes are powers of two, so
+// texel coordinates wrap around with a mask and rows of tiles are a shift apart
+typedef struct {
+  int width;
+  int height;
+  int width_mask;     // width - 1
+  int height_mask;    // height - 1
+  int tile_row_shift; // log2 of the texels in one row of tiles
+  float scale_u;      // width, to map u to texel x
+  float scale_v;      // height, to map v to texel y
+  uint32_t *buffer;   // tiled texels, in the color buffer format (RGBA32)
+} mip_level_t;
+
+// Texels of a mip level a texture may be sampled from, bounds included
+typedef struct {
+  int min_x;
+  int min_y;
+  int max_x;
+  int max_y;
+} texel_rect_t;
+
+// Index of texel (x,y) in a tiled buffer with rows of 2^tile_row_shift texels
+static inline int texel_address(int x, int y, int tile_row_shift) {
+  return ((y >> TEXTURE_TILE_BITS) << tile_row_shift) +
+         ((x >> TEXTURE_TILE_BITS) << (2 * TEXTURE_TILE_BITS)) +
+         ((y & (TEXTURE_TILE_SIZE - 1)) << TEXTURE_TILE_BITS) +
+         (x & (TEXTURE_TILE_SIZE - 1));
+}
+
+// Textures of ATLAS_MIN_TEXTURE_SIZE to ATLAS_MAX_TEXTURE_SIZE texels on a
+// side can be packed into shared atlas pages of up to ATLAS_PAGE_SIZE x
+// ATLAS_PAGE_SIZE texels. The mip pyramid of a page stops at the level where
+// its smallest texture is one texel wide, so the minimum keeps every page at
+// least log2(ATLAS_MIN_TEXTURE_SIZE) + 1 levels deep
+#define ATLAS_MIN_TEXTURE_SIZE 32
+#define ATLAS_MAX_TEXTURE_SIZE 512
+#define ATLAS_PAGE_SIZE 1024
+
+// texture_t keeps what the rasterizer needs from a decoded PNG, converted once
+// at load time. Textures are registered once in a table and referred to by
+// their index in it (their handle), so the render queue can store 16 bits
+// instead of a pointer
+typedef struct {
+  int width;   // size of the PNG (of the page for atlas pages)
+  int height;
+  upng_t *png; // owned by whoever loaded it, NULL for atlas pages
+  // Atlas page the texture was packed into (-1 if it was not), and where in
+  // it: page UVs (v growing downwards) of its corner and its size in page UVs
+  int atlas_page;
+  tex2_t atlas_offset;
+  tex2_t atlas_scale;
+  // Mip pyramid in tiled layout: level 0 holds the pixels of the PNG (scaled
+  // up to powers of two), every next level halves both sizes (down to 1) and
+  // averages the texels it covers. A packed texture hands its own pyramid
+  // over to the page and its levels point at the page's
+  int num_levels;
+  mip_level_t levels[MAX_MIP_LEVELS];
+  // Texels of every level that belong to the texture: its cell for a packed
+  // texture, so samples never reach into a neighbour, and unbounded otherwise
+  // so the samplers can repeat it
+  texel_rect_t cells[MAX_MIP_LEVELS];
+} texture_t;
+
 tex2_t tex2_clone(tex2_t *t);
 
+/**
+ * Add a decoded PNG to the texture table, build its mip pyramid and return its
+ * handle, or -1 when png is NULL or in an unknown format
+ */
+int add_texture(upng_t *png);
+texture_t *get_texture(int handle);
+
+/**
+ * Handle of the texture holding the texels of texture handle: its atlas page
+ * if it was packed, itself otherwise
+ */
+int get_texture_page(int handle);
+
+/**
+ * Pack the textures with the given handles into shared atlas pages, so
+ * triangles of different meshes can be drawn without switching textures.
+ * Textures smaller than ATLAS_MIN_TEXTURE_SIZE or larger than
+ * ATLAS_MAX_TEXTURE_SIZE and pages that would hold a single texture are left
+ * alone. The UVs of whatever uses a packed texture
+ * must go through atlas_texcoord, and must not repeat it (stay inside [0, 1])
+ */
+void pack_textures(int *handles, int count);
+
+/**
+ * Map a texture coordinate of a packed texture, as read from an OBJ file (v
+ * growing upwards), to the same texel of its atlas page
+ */
+tex2_t atlas_texcoord(texture_t *texture, tex2_t uv);
+
+void free_textures(void);
+
 #endif
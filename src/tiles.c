@@ -0,0 +1,136 @@
+#include "tiles.h"
+#include "array.h"
+#include "jobs.h"
+
+typedef struct {
+  rect_t rect;    // pixels owned by this tile
+  int *triangles; // dynamic array of render queue indices, in submission order
+} tile_t;
+
+static tile_t *tiles = NULL;
+static int num_tiles_x = 0;
+static int num_tiles_y = 0;
+static int num_tiles = 0;
+
+// Work of the current frame, shared with the tile jobs
+static tile_draw_fn frame_draw_depth = NULL;
+static tile_draw_fn frame_draw_triangle = NULL;
+static tile_pass_fn frame_pass = NULL;
+
+/**
+ * Job drawing the triangles binned into one tile
+ */
+static void draw_tile(int tile_index, void *data) {
+  (void)data;
+  tile_t *tile = &tiles[tile_index];
+  int num_triangles = array_length(tile->triangles);
+  // The depth prepass runs over the tile's whole list first, while the tile's
+  // part of the z-buffer is still in cache for the shading pass
+  if (frame_draw_depth != NULL) {
+    for (int i = 0; i < num_triangles; i++) {
+      frame_draw_depth(tile->triangles[i], tile->rect);
+    }
+  }
+  for (int i = 0; i < num_triangles; i++) {
+    frame_draw_triangle(tile->triangles[i], tile->rect);
+  }
+}
+
+void init_tile_renderer(void) {
+  num_tiles_x = (get_window_width() + TILE_SIZE - 1) / TILE_SIZE;
+  num_tiles_y = (get_window_height() + TILE_SIZE - 1) / TILE_SIZE;
+  num_tiles = num_tiles_x * num_tiles_y;
+  tiles = (tile_t *)calloc(num_tiles, sizeof(tile_t));
+
+  for (int y = 0; y < num_tiles_y; y++) {
+    for (int x = 0; x < num_tiles_x; x++) {
+      rect_t *rect = &tiles[(y * num_tiles_x) + x].rect;
+      rect->min_x = x * TILE_SIZE;
+      rect->min_y = y * TILE_SIZE;
+      rect->max_x = rect->min_x + TILE_SIZE - 1;
+      rect->max_y = rect->min_y + TILE_SIZE - 1;
+      if (rect->max_x > get_window_width() - 1)
+        rect->max_x = get_window_width() - 1;
+      if (rect->max_y > get_window_height() - 1)
+        rect->max_y = get_window_height() - 1;
+    }
+  }
+}
+
+/**
+ * Put the index of every triangle into the bin of each tile its screen
+ * bounding box overlaps
+ */
+static void bin_triangles(triangle_position_t *triangles, int num_triangles) {
+  for (int i = 0; i < num_tiles; i++) {
+    array_clear(tiles[i].triangles);
+  }
+
+  // The vertex markers of the wire+vertex mode reach a few pixels past the
+  // triangle itself
+  int margin = should_render_wire_vertex() ? 4 : 0;
+  rect_t screen = get_screen_rect();
+
+  for (int i = 0; i < num_triangles; i++) {
+    int x0 = subpixel_to_pixel(triangles[i].x[0]);
+    int y0 = subpixel_to_pixel(triangles[i].y[0]);
+    int x1 = subpixel_to_pixel(triangles[i].x[1]);
+    int y1 = subpixel_to_pixel(triangles[i].y[1]);
+    int x2 = subpixel_to_pixel(triangles[i].x[2]);
+    int y2 = subpixel_to_pixel(triangles[i].y[2]);
+
+    int min_x = (x0 < x1 ? (x0 < x2 ? x0 : x2) : (x1 < x2 ? x1 : x2)) - margin;
+    int min_y = (y0 < y1 ? (y0 < y2 ? y0 : y2) : (y1 < y2 ? y1 : y2)) - margin;
+    int max_x = (x0 > x1 ? (x0 > x2 ? x0 : x2) : (x1 > x2 ? x1 : x2)) + margin;
+    int max_y = (y0 > y1 ? (y0 > y2 ? y0 : y2) : (y1 > y2 ? y1 : y2)) + margin;
+
+    if (min_x < screen.min_x)
+      min_x = screen.min_x;
+    if (min_y < screen.min_y)
+      min_y = screen.min_y;
+    if (max_x > screen.max_x)
+      max_x = screen.max_x;
+    if (max_y > screen.max_y)
+      max_y = screen.max_y;
+    if (min_x > max_x || min_y > max_y) {
+      continue;
+    }
+
+    for (int ty = min_y / TILE_SIZE; ty <= max_y / TILE_SIZE; ty++) {
+      for (int tx = min_x / TILE_SIZE; tx <= max_x / TILE_SIZE; tx++) {
+        array_push(tiles[(ty * num_tiles_x) + tx].triangles, i);
+      }
+    }
+  }
+}
+
+void render_tiles(triangle_position_t *triangles, int num_triangles,
+                  tile_draw_fn draw_depth, tile_draw_fn draw_triangle) {
+  bin_triangles(triangles, num_triangles);
+
+  frame_draw_depth = draw_depth;
+  frame_draw_triangle = draw_triangle;
+  run_jobs(num_tiles, draw_tile, NULL);
+}
+
+/**
+ * Job running the current full-screen pass over one tile
+ */
+static void run_pass_on_tile(int tile_index, void *data) {
+  (void)data;
+  frame_pass(tiles[tile_index].rect);
+}
+
+void run_tile_pass(tile_pass_fn pass) {
+  frame_pass = pass;
+  run_jobs(num_tiles, run_pass_on_tile, NULL);
+}
+
+void destroy_tile_renderer(void) {
+  for (int i = 0; i < num_tiles; i++) {
+    array_free(tiles[i].triangles);
+  }
+  free(tiles);
+  tiles = NULL;
+  num_tiles = 0;
+}
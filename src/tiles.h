@@ -0,0 +1,47 @@
+#ifndef TILES_H
+#define TILES_H
+
+#include "display.h"
+#include "triangle.h"
+
+// Screen tiles are TILE_SIZE x TILE_SIZE pixels. Keep this a multiple of the
+// SIMD block width so rasterizer blocks never cross a tile border, and of
+// DEPTH_TILE_SIZE so every coarse depth tile is owned by a single tile
+#define TILE_SIZE 64
+
+#if TILE_SIZE % DEPTH_TILE_SIZE != 0
+#error "TILE_SIZE must be a multiple of DEPTH_TILE_SIZE"
+#endif
+
+// Function that draws the triangle at index triangle of the render queue,
+// limited to the given tile rectangle
+typedef void (*tile_draw_fn)(int triangle, rect_t tile);
+
+// Function processing the pixels of one tile rectangle
+typedef void (*tile_pass_fn)(rect_t tile);
+
+/**
+ * Split the window into tiles
+ */
+void init_tile_renderer(void);
+
+/**
+ * Sort-middle rendering of the triangle queue: bin every triangle into the
+ * tiles its bounding box touches, then draw the tiles in parallel on the job
+ * threads. Each tile owns its own part of the color and depth buffers and
+ * draws its triangles in submission order, so the result matches drawing the
+ * queue on one thread. When draw_depth is not NULL every tile first runs it
+ * over all of its triangles (depth prepass) before drawing them
+ */
+void render_tiles(triangle_position_t *triangles, int num_triangles,
+                  tile_draw_fn draw_depth, tile_draw_fn draw_triangle);
+
+/**
+ * Run a full-screen pass (like the visibility buffer resolve) tile by tile in
+ * parallel on the job threads
+ */
+void run_tile_pass(tile_pass_fn pass);
+
+void destroy_tile_renderer(void);
+
+#endif
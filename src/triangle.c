@@ -1,6 +1,8 @@
 #include "triangle.h"
 #include "display.h"
+#include "simd.h"
 #include "swap.h"
+#include <limits.h>
 
 /**
  * Return the barycentric weights alpha, beta, and gamma for point p
@@ -49,197 +51,833 @@ vec3_t barycentric_weights(vec2_t a, vec2_t b, vec2_t c, vec2_t p) {
 // Draw a triangle using three raw line calls
 ///////////////////////////////////////////////////////////////////////////////
 void draw_triangle(int x0, int y0, int x1, int y1, int x2, int y2,
-                   uint32_t color) {
-  draw_line(x0, y0, x1, y1, color);
-  draw_line(x1, y1, x2, y2, color);
-  draw_line(x2, y2, x0, y0, color);
+                   uint32_t color, rect_t scissor) {
+  draw_line_scissored(x0, y0, x1, y1, color, scissor);
+  draw_line_scissored(x1, y1, x2, y2, color, scissor);
+  draw_line_scissored(x2, y2, x0, y0, color, scissor);
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// Half-space rasterizer core
+///////////////////////////////////////////////////////////////////////////////
+// Each edge of the triangle is written as an edge function
+//
+//   E(x, y) = (y0 - y1) * (x - x0) + (x1 - x0) * (y - y0)
+//
+// which is positive on the inside of the edge, zero on it and negative on the
+// outside. Vertices are in 28.4 fixed point and pixels are sampled at their
+// centers, so E is an exact integer and the fill rule below decides every
+// sample lying on an edge: pixels shared by two triangles are drawn exactly
+// once.
+//
+// Stepping one pixel changes x by SUBPIXEL_SCALE, so E moves in multiples of
+// SUBPIXEL_SCALE and its low bits stay the same over the whole triangle. The
+// loops therefore walk floor(E / SUBPIXEL_SCALE), which has the same sign as
+// E, steps by the plain coordinate deltas and stays well inside 32 bits.
+//
+// The edge functions only decide coverage. 1/w, U/w and V/w are linear in
+// screen space, so triangle setup turns them into gradients once; the loops
+// evaluate them at the start of every row and step them across it with one
+// addition per pixel (or block), leaving a single division per pixel to get
+// U and V back.
+///////////////////////////////////////////////////////////////////////////////
+typedef struct {
+  int step_x; // change of the edge function for one pixel to the right
+  int step_y; // change of the edge function for one pixel down
+  int row;    // value of the edge function at the start of the current row
+} edge_t;
+
+// A value that is linear in screen space, given by its value at the center of
+// one pixel and how much it changes from one pixel to the next
+typedef struct {
+  int x, y;     // pixel the value is given at (the one holding vertex a)
+  float value;  // value at the center of that pixel
+  float step_x; // change for one pixel to the right
+  float step_y; // change for one pixel down
+} gradient_t;
+
+// Everything the rasterizer loops need about one triangle
+typedef struct {
+  int min_x, min_y, max_x, max_y; // scissor-clamped bounding box, in pixels
+  edge_t edges[3];                // edges BC, CA and AB, evaluated at min x/y
+  gradient_t reciprocal_w;        // 1/w across the screen
+  gradient_t u_over_w;            // U/w, zero unless the triangle is textured
+  gradient_t v_over_w;            // V/w, zero unless the triangle is textured
+  float nearest_depth;            // depth of the vertex closest to the camera
+  bool writes_depth;              // the shader updates the z-buffer
+} triangle_setup_t;
+
+typedef void (*pixel_shader_t)(int x, int y, interpolants_t values,
+                               triangle_attribs_t *attribs);
+
+// depth test of the shading functions (see set_depth_test)
+static int depth_test = DEPTH_TEST_LESS;
+
+void set_depth_test(int test) { depth_test = test; }
+
+// filter of the textured shading functions (see set_texture_filter)
+static int texture_filter = TEXTURE_FILTER_NEAREST;
+
+void set_texture_filter(int filter) { texture_filter = filter; }
+
+// sample textures from the mip level matching their size on screen
+static bool mipmapping = true;
+
+void set_mipmapping(bool enabled) { mipmapping = enabled; }
+
+/**
+ * Depth test of the shading functions for a pixel at depth z against the
+ * stored depth
+ **/
+static bool passes_depth_test(float z, float stored) {
+  return depth_test == DEPTH_TEST_EQUAL ? z == stored : z < stored;
+}
+
+static int min3(int a, int b, int c) {
+  int m = a < b ? a : b;
+  return m < c ? m : c;
+}
+
+static int max3(int a, int b, int c) {
+  int m = a > b ? a : b;
+  return m > c ? m : c;
+}
+
+/**
+ * Depth of the vertex closest to the camera. Depth is 1 - 1/w, which is linear
+ * in screen space, so no pixel of the triangle is nearer than its nearest
+ * vertex; the small margin covers the rounding of the interpolated 1/w
+ **/
+static float nearest_depth(triangle_position_t *triangle) {
+  vec3_t reciprocal_w = triangle->reciprocal_w;
+  float max_reciprocal_w = reciprocal_w.x > reciprocal_w.y ? reciprocal_w.x
+                                                           : reciprocal_w.y;
+  if (reciprocal_w.z > max_reciprocal_w)
+    max_reciprocal_w = reciprocal_w.z;
+  return 1.0 - max_reciprocal_w * 1.00001;
+}
+
+/**
+ * Set up the edge function of the edge going from (x0,y0) to (x1,y1) and
+ * evaluate it at the subpixel position (px,py) of the first pixel center.
+ * orientation is +1 or -1 so that the inside of the triangle is always
+ * positive, whatever its winding.
+ **/
+static edge_t make_edge(int x0, int y0, int x1, int y1, int px, int py,
+                        int orientation) {
+  edge_t edge;
+  edge.step_x = (y0 - y1) * orientation;
+  edge.step_y = (x1 - x0) * orientation;
+
+  // Top-left fill rule: samples lying exactly on an edge are only drawn when
+  // the edge is a top edge (horizontal, inside below it) or a left edge
+  // (inside to its right). Two triangles sharing an edge therefore never both
+  // draw it, and never both leave it out
+  bool is_top = edge.step_x == 0 && edge.step_y > 0;
+  bool is_left = edge.step_x > 0;
+  int bias = (is_top || is_left) ? 0 : -1;
+
+  // Evaluated in 64 bits: the vertices may lie far outside the screen
+  int64_t value = (int64_t)edge.step_x * (px - x0) +
+                  (int64_t)edge.step_y * (py - y0) + bias;
+  edge.row = (int)(value >> SUBPIXEL_BITS);
+
+  return edge;
+}
+
+/**
+ * Screen space gradient of the per-vertex values of a triangle, from its
+ * subpixel vertex positions
+ **/
+static gradient_t make_gradient(triangle_position_t *triangle,
+                                vec3_t values) {
+  double x0 = (double)triangle->x[0] / SUBPIXEL_SCALE;
+  double y0 = (double)triangle->y[0] / SUBPIXEL_SCALE;
+  double dx1 = (double)(triangle->x[1] - triangle->x[0]) / SUBPIXEL_SCALE;
+  double dy1 = (double)(triangle->y[1] - triangle->y[0]) / SUBPIXEL_SCALE;
+  double dx2 = (double)(triangle->x[2] - triangle->x[0]) / SUBPIXEL_SCALE;
+  double dy2 = (double)(triangle->y[2] - triangle->y[0]) / SUBPIXEL_SCALE;
+  double area = dx1 * dy2 - dx2 * dy1;
+  double da1 = values.y - values.x;
+  double da2 = values.z - values.x;
+
+  double step_x = (da1 * dy2 - da2 * dy1) / area;
+  double step_y = (da2 * dx1 - da1 * dx2) / area;
+
+  gradient_t gradient;
+  gradient.x = subpixel_to_pixel(triangle->x[0]);
+  gradient.y = subpixel_to_pixel(triangle->y[0]);
+  gradient.value = values.x + step_x * (gradient.x + 0.5 - x0) +
+                   step_y * (gradient.y + 0.5 - y0);
+  gradient.step_x = step_x;
+  gradient.step_y = step_y;
+  return gradient;
+}
+
+static float evaluate_gradient(gradient_t *gradient, int x, int y) {
+  return (gradient->value + gradient->step_y * (y - gradient->y)) +
+         gradient->step_x * (x - gradient->x);
+}
+
+/**
+ * Compute the bounding box and edge functions of a queued triangle. Returns
+ * false when the triangle is degenerate, covers no pixel center inside the
+ * scissor rectangle or is hidden behind everything drawn there so far
+ **/
+static bool setup_triangle(triangle_position_t *triangle, rect_t scissor,
+                           triangle_setup_t *setup) {
+  int x0 = triangle->x[0], y0 = triangle->y[0];
+  int x1 = triangle->x[1], y1 = triangle->y[1];
+  int x2 = triangle->x[2], y2 = triangle->y[2];
+
+  // Twice the signed area of the triangle; degenerate triangles cover nothing
+  int64_t area = (int64_t)(x1 - x0) * (y2 - y0) -
+                 (int64_t)(y1 - y0) * (x2 - x0);
+  if (area == 0) {
+    return false;
+  }
+  int orientation = area > 0 ? 1 : -1;
+
+  // Pixels whose centers (at half a pixel) lie inside the bounding box of the
+  // triangle, clamped to the scissor rectangle
+  int half = SUBPIXEL_SCALE / 2;
+  int round_up = SUBPIXEL_SCALE - 1;
+  setup->min_x = (min3(x0, x1, x2) - half + round_up) >> SUBPIXEL_BITS;
+  setup->min_y = (min3(y0, y1, y2) - half + round_up) >> SUBPIXEL_BITS;
+  setup->max_x = (max3(x0, x1, x2) - half) >> SUBPIXEL_BITS;
+  setup->max_y = (max3(y0, y1, y2) - half) >> SUBPIXEL_BITS;
+  if (setup->min_x < scissor.min_x)
+    setup->min_x = scissor.min_x;
+  if (setup->min_y < scissor.min_y)
+    setup->min_y = scissor.min_y;
+  if (setup->max_x > scissor.max_x)
+    setup->max_x = scissor.max_x;
+  if (setup->max_y > scissor.max_y)
+    setup->max_y = scissor.max_y;
+  if (setup->min_x > setup->max_x || setup->min_y > setup->max_y) {
+    return false;
+  }
+
+  // Hierarchical depth test: skip the triangle when its nearest point is not
+  // in front of the farthest depth of the depth tiles it touches
+  rect_t bounds = {setup->min_x, setup->min_y, setup->max_x, setup->max_y};
+  setup->nearest_depth = nearest_depth(triangle);
+  if (setup->nearest_depth >= get_z_tiles_max(bounds)) {
+    return false;
+  }
+
+  // Edge BC weighs vertex A, edge CA weighs vertex B, edge AB weighs vertex C
+  int px = setup->min_x * SUBPIXEL_SCALE + half;
+  int py = setup->min_y * SUBPIXEL_SCALE + half;
+  setup->edges[0] = make_edge(x1, y1, x2, y2, px, py, orientation);
+  setup->edges[1] = make_edge(x2, y2, x0, y0, px, py, orientation);
+  setup->edges[2] = make_edge(x0, y0, x1, y1, px, py, orientation);
+  setup->writes_depth = true;
+
+  // Every shader needs depth; draw_textured_triangle adds the UV gradients
+  setup->reciprocal_w = make_gradient(triangle, triangle->reciprocal_w);
+  setup->u_over_w = setup->v_over_w = (gradient_t){0};
+
+  return true;
+}
+
+/**
+ * Refresh the coarse depth of the blocks between pixels min_x and max_x of the
+ * block row holding pixel row y, once a triangle is done drawing into them.
+ * Resets the range for the next block row
+ **/
+static void update_drawn_blocks(int y, int *min_x, int *max_x) {
+  if (*min_x <= *max_x) {
+    update_z_blocks(y / DEPTH_BLOCK_SIZE, *min_x / DEPTH_BLOCK_SIZE,
+                    *max_x / DEPTH_BLOCK_SIZE);
+  }
+  *min_x = INT_MAX;
+  *max_x = -1;
+}
+
+#if SIMD_WIDTH == 1
+/**
+ * Walk the bounding box one pixel at a time and call shade_pixel for every
+ * covered pixel with its interpolated 1/w, U/w and V/w
+ **/
+static void rasterize_triangle(triangle_setup_t *setup,
+                               pixel_shader_t shade_pixel,
+                               triangle_attribs_t *attribs) {
+  edge_t e0 = setup->edges[0];
+  edge_t e1 = setup->edges[1];
+  edge_t e2 = setup->edges[2];
+  interpolants_t step = {setup->reciprocal_w.step_x, setup->u_over_w.step_x,
+                         setup->v_over_w.step_x};
+  float nearest = setup->nearest_depth;
+  int blocks_x = get_z_blocks_x();
+  int drawn_min_x = INT_MAX;
+  int drawn_max_x = -1;
+
+  for (int y = setup->min_y; y <= setup->max_y; y++) {
+    int w0 = e0.row;
+    int w1 = e1.row;
+    int w2 = e2.row;
+    float *block_max =
+        get_z_block_max() + ((y / DEPTH_BLOCK_SIZE) * blocks_x);
+    interpolants_t values = {
+        evaluate_gradient(&setup->reciprocal_w, setup->min_x, y),
+        evaluate_gradient(&setup->u_over_w, setup->min_x, y),
+        evaluate_gradient(&setup->v_over_w, setup->min_x, y)};
+
+    for (int x = setup->min_x; x <= setup->max_x; x++) {
+      // Stepping restarts at every depth tile column, where screen tiles
+      // start, so a pixel gets the same values whichever tile draws it
+      if (x % DEPTH_TILE_SIZE == 0) {
+        values.reciprocal_w = evaluate_gradient(&setup->reciprocal_w, x, y);
+        values.u_over_w = evaluate_gradient(&setup->u_over_w, x, y);
+        values.v_over_w = evaluate_gradient(&setup->v_over_w, x, y);
+      }
+      // All three edge functions are non-negative (sign bits clear) and the
+      // pixel's depth block is not already in front of the whole triangle
+      if ((w0 | w1 | w2) >= 0 && nearest < block_max[x / DEPTH_BLOCK_SIZE]) {
+        shade_pixel(x, y, values, attribs);
+        drawn_min_x = x < drawn_min_x ? x : drawn_min_x;
+        drawn_max_x = x;
+      }
+      w0 += e0.step_x;
+      w1 += e1.step_x;
+      w2 += e2.step_x;
+      values.reciprocal_w += step.reciprocal_w;
+      values.u_over_w += step.u_over_w;
+      values.v_over_w += step.v_over_w;
+    }
+
+    e0.row += e0.step_y;
+    e1.row += e1.step_y;
+    e2.row += e2.step_y;
+
+    if (setup->writes_depth &&
+        ((y + 1) % DEPTH_BLOCK_SIZE == 0 || y == setup->max_y)) {
+      update_drawn_blocks(y, &drawn_min_x, &drawn_max_x);
+    }
+  }
+}
+#else
+///////////////////////////////////////////////////////////////////////////////
+// SIMD rasterizer: the same edge walk, SIMD_WIDTH pixels of a row at a time
+///////////////////////////////////////////////////////////////////////////////
+// Blocks start on multiples of SIMD_WIDTH so they never straddle a scissor
+// rectangle (screen tile) owned by another thread. Block shaders receive the
+// lane coverage mask and the interpolated values of every lane, do the depth
+// test for the whole block and write only the lanes that pass. Blocks hanging
+// off the right edge of the screen go through the scalar pixel shader lane by
+// lane instead. SIMD_WIDTH divides DEPTH_BLOCK_SIZE, so every block lies in a
+// single depth block (and so in a single screen tile).
+///////////////////////////////////////////////////////////////////////////////
+#if DEPTH_BLOCK_SIZE % SIMD_WIDTH != 0
+#error "DEPTH_BLOCK_SIZE must be a multiple of SIMD_WIDTH"
+#endif
+
+typedef void (*block_shader_t)(int x, int y, simd_int mask,
+                               simd_float reciprocal_w, simd_float u_over_w,
+                               simd_float v_over_w,
+                               triangle_attribs_t *attribs);
+
+/**
+ * Values of gradient for the SIMD_WIDTH pixels of row y starting at x
+ **/
+static simd_float simd_evaluate_gradient(gradient_t *gradient, int x, int y) {
+  simd_float row_value =
+      simd_set1_f(gradient->value + gradient->step_y * (y - gradient->y));
+  simd_float dx = simd_cvt_i2f(simd_ramp_i(x - gradient->x, 1));
+  return simd_add_f(row_value,
+                    simd_mul_f(simd_set1_f(gradient->step_x), dx));
+}
+
+static void rasterize_triangle_blocks(triangle_setup_t *setup,
+                                      block_shader_t shade_block,
+                                      pixel_shader_t shade_pixel,
+                                      triangle_attribs_t *attribs) {
+  edge_t *e = setup->edges;
+  int start_x = setup->min_x & ~(SIMD_WIDTH - 1);
+  int window_width = get_window_width();
+
+  simd_float block_step_w =
+      simd_set1_f(setup->reciprocal_w.step_x * SIMD_WIDTH);
+  simd_float block_step_u = simd_set1_f(setup->u_over_w.step_x * SIMD_WIDTH);
+  simd_float block_step_v = simd_set1_f(setup->v_over_w.step_x * SIMD_WIDTH);
+  simd_int block_step0 = simd_set1_i(e[0].step_x * SIMD_WIDTH);
+  simd_int block_step1 = simd_set1_i(e[1].step_x * SIMD_WIDTH);
+  simd_int block_step2 = simd_set1_i(e[2].step_x * SIMD_WIDTH);
+  simd_int minus_one = simd_set1_i(-1);
+  simd_int end_x = simd_set1_i(setup->max_x + 1);
+  float nearest = setup->nearest_depth;
+  int blocks_x = get_z_blocks_x();
+  int drawn_min_x = INT_MAX;
+  int drawn_max_x = -1;
+
+  // Move the row start values back from min_x to the aligned block start
+  int row0 = e[0].row - e[0].step_x * (setup->min_x - start_x);
+  int row1 = e[1].row - e[1].step_x * (setup->min_x - start_x);
+  int row2 = e[2].row - e[2].step_x * (setup->min_x - start_x);
+
+  for (int y = setup->min_y; y <= setup->max_y; y++) {
+    simd_int w0 = simd_ramp_i(row0, e[0].step_x);
+    simd_int w1 = simd_ramp_i(row1, e[1].step_x);
+    simd_int w2 = simd_ramp_i(row2, e[2].step_x);
+    simd_float reciprocal_w =
+        simd_evaluate_gradient(&setup->reciprocal_w, start_x, y);
+    simd_float u_over_w = simd_evaluate_gradient(&setup->u_over_w, start_x, y);
+    simd_float v_over_w = simd_evaluate_gradient(&setup->v_over_w, start_x, y);
+    float *block_max =
+        get_z_block_max() + ((y / DEPTH_BLOCK_SIZE) * blocks_x);
+
+    for (int x = start_x; x <= setup->max_x; x += SIMD_WIDTH) {
+      // Stepping restarts at every depth tile column, where screen tiles
+      // start, so a pixel gets the same values whichever tile draws it
+      if (x % DEPTH_TILE_SIZE == 0) {
+        reciprocal_w = simd_evaluate_gradient(&setup->reciprocal_w, x, y);
+        u_over_w = simd_evaluate_gradient(&setup->u_over_w, x, y);
+        v_over_w = simd_evaluate_gradient(&setup->v_over_w, x, y);
+      }
+
+      // Lanes where all three edge functions are non-negative, limited to the
+      // (screen-clamped) bounding box
+      simd_int outside = simd_or_i(simd_or_i(w0, w1), w2);
+      simd_int mask = simd_and_i(simd_cmpgt_i(outside, minus_one),
+                                 simd_cmpgt_i(end_x, simd_ramp_i(x, 1)));
+
+      // Skip blocks whose depth block is already in front of the whole
+      // triangle
+      if (simd_movemask(mask) && nearest < block_max[x / DEPTH_BLOCK_SIZE]) {
+        drawn_min_x = x < drawn_min_x ? x : drawn_min_x;
+        drawn_max_x = x;
+
+        if (x + SIMD_WIDTH <= window_width) {
+          shade_block(x, y, mask, reciprocal_w, u_over_w, v_over_w, attribs);
+        } else {
+          float ws[SIMD_WIDTH], us[SIMD_WIDTH], vs[SIMD_WIDTH];
+          simd_store_f(ws, reciprocal_w);
+          simd_store_f(us, u_over_w);
+          simd_store_f(vs, v_over_w);
+          int bits = simd_movemask(mask);
+          for (int i = 0; i < SIMD_WIDTH; i++) {
+            if (bits & (1 << i)) {
+              interpolants_t values = {ws[i], us[i], vs[i]};
+              shade_pixel(x + i, y, values, attribs);
+            }
+          }
+        }
+      }
+
+      w0 = simd_add_i(w0, block_step0);
+      w1 = simd_add_i(w1, block_step1);
+      w2 = simd_add_i(w2, block_step2);
+      reciprocal_w = simd_add_f(reciprocal_w, block_step_w);
+      u_over_w = simd_add_f(u_over_w, block_step_u);
+      v_over_w = simd_add_f(v_over_w, block_step_v);
+    }
+
+    row0 += e[0].step_y;
+    row1 += e[1].step_y;
+    row2 += e[2].step_y;
+
+    if (setup->writes_depth &&
+        ((y + 1) % DEPTH_BLOCK_SIZE == 0 || y == setup->max_y)) {
+      update_drawn_blocks(y, &drawn_min_x, &drawn_max_x);
+    }
+  }
+}
+
+/**
+ * Block version of texel_address for the mip level texture
+ **/
+static simd_int simd_texel_address(mip_level_t *texture, simd_int x,
+                                   simd_int y) {
+  simd_int in_tile = simd_set1_i(TEXTURE_TILE_SIZE - 1);
+  simd_int row_offset = simd_slli_i(simd_srli_i(y, TEXTURE_TILE_BITS),
+                                    texture->tile_row_shift);
+  simd_int tile_offset = simd_slli_i(simd_srli_i(x, TEXTURE_TILE_BITS),
+                                     2 * TEXTURE_TILE_BITS);
+  simd_int texel_offset =
+      simd_add_i(simd_slli_i(simd_and_i(y, in_tile), TEXTURE_TILE_BITS),
+                 simd_and_i(x, in_tile));
+  return simd_add_i(simd_add_i(row_offset, tile_offset), texel_offset);
+}
+
+/**
+ * Block version of lerp_texels, with a blend factor per lane
+ **/
+static simd_int simd_lerp_texels(simd_int a, simd_int b, simd_int f) {
+  simd_int low = simd_set1_i(0x00FF00FF);
+  simd_int high = simd_set1_i(0xFF00FF00);
+  simd_int weight_b = simd_or_i(f, simd_slli_i(f, 16));
+  simd_int weight_a = simd_sub_i(simd_set1_i(0x01000100), weight_b);
+  simd_int rb = simd_add_i(simd_mullo_i16(simd_and_i(a, low), weight_a),
+                           simd_mullo_i16(simd_and_i(b, low), weight_b));
+  simd_int ga = simd_add_i(
+      simd_mullo_i16(simd_and_i(simd_srli_i(a, 8), low), weight_a),
+      simd_mullo_i16(simd_and_i(simd_srli_i(b, 8), low), weight_b));
+  return simd_or_i(simd_and_i(simd_srli_i(rb, 8), low), simd_and_i(ga, high));
+}
+
+/**
+ * Block versions of wrap_texel_x and wrap_texel_y
+ **/
+static simd_int simd_wrap_texel_x(triangle_attribs_t *attribs, simd_int x) {
+  x = simd_min_i(simd_max_i(x, simd_set1_i(attribs->cell.min_x)),
+                 simd_set1_i(attribs->cell.max_x));
+  return simd_and_i(x, simd_set1_i(attribs->texture->width_mask));
+}
+
+static simd_int simd_wrap_texel_y(triangle_attribs_t *attribs, simd_int y) {
+  y = simd_min_i(simd_max_i(y, simd_set1_i(attribs->cell.min_y)),
+                 simd_set1_i(attribs->cell.max_y));
+  return simd_and_i(y, simd_set1_i(attribs->texture->height_mask));
+}
+
+/**
+ * Block version of sample_texture_bilinear: fetch the 2x2 texels around the
+ * UVs of every lane in mask and blend them with 8-bit integer lerps
+ **/
+static simd_int simd_sample_texture_bilinear(triangle_attribs_t *attribs,
+                                             simd_float u, simd_float v,
+                                             simd_int mask) {
+  mip_level_t *texture = attribs->texture;
+  simd_float half = simd_set1_f(0.5f);
+  simd_float fixed_one = simd_set1_f(256.0f);
+  simd_int s = simd_floor_f2i(simd_mul_f(
+      simd_sub_f(simd_mul_f(u, simd_set1_f(texture->scale_u)), half),
+      fixed_one));
+  simd_int t = simd_floor_f2i(simd_mul_f(
+      simd_sub_f(simd_mul_f(v, simd_set1_f(texture->scale_v)), half),
+      fixed_one));
+
+  simd_int one = simd_set1_i(1);
+  simd_int x0 = simd_srai_i(s, 8);
+  simd_int y0 = simd_srai_i(t, 8);
+  simd_int x1 = simd_wrap_texel_x(attribs, simd_add_i(x0, one));
+  simd_int y1 = simd_wrap_texel_y(attribs, simd_add_i(y0, one));
+  x0 = simd_wrap_texel_x(attribs, x0);
+  y0 = simd_wrap_texel_y(attribs, y0);
+
+  simd_int texel00 = simd_gather_i(
+      texture->buffer, simd_texel_address(texture, x0, y0), mask);
+  simd_int texel10 = simd_gather_i(
+      texture->buffer, simd_texel_address(texture, x1, y0), mask);
+  simd_int texel01 = simd_gather_i(
+      texture->buffer, simd_texel_address(texture, x0, y1), mask);
+  simd_int texel11 = simd_gather_i(
+      texture->buffer, simd_texel_address(texture, x1, y1), mask);
+
+  simd_int fraction = simd_set1_i(255);
+  simd_int fx = simd_and_i(s, fraction);
+  simd_int fy = simd_and_i(t, fraction);
+  return simd_lerp_texels(simd_lerp_texels(texel00, texel10, fx),
+                          simd_lerp_texels(texel01, texel11, fx), fy);
+}
+
+/**
+ * Block version of sample_texture: map the UVs of every lane to texel
+ * coordinates (wrapping around) and fetch the texels of the lanes in mask
+ **/
+static simd_int simd_sample_texture(triangle_attribs_t *attribs, simd_float u,
+                                    simd_float v, simd_int mask) {
+  if (texture_filter == TEXTURE_FILTER_BILINEAR) {
+    return simd_sample_texture_bilinear(attribs, u, v, mask);
+  }
+
+  mip_level_t *texture = attribs->texture;
+  simd_int tex_x = simd_wrap_texel_x(
+      attribs, simd_floor_f2i(simd_mul_f(u, simd_set1_f(texture->scale_u))));
+  simd_int tex_y = simd_wrap_texel_y(
+      attribs, simd_floor_f2i(simd_mul_f(v, simd_set1_f(texture->scale_v))));
+  simd_int tex_index = simd_texel_address(texture, tex_x, tex_y);
+
+  return simd_gather_i(texture->buffer, tex_index, mask);
+}
+
+/**
+ * Block version of passes_depth_test: narrow mask down to the lanes passing
+ * the depth test of the shading functions
+ **/
+static simd_int simd_depth_test(simd_int mask, simd_float z,
+                                simd_float stored) {
+  simd_int passed = depth_test == DEPTH_TEST_EQUAL ? simd_cmpeq_f(z, stored)
+                                                   : simd_cmplt_f(z, stored);
+  return simd_and_i(mask, passed);
+}
+
+/**
+ * Block version of draw_depth_pixel: depth test and depth write only for
+ * SIMD_WIDTH pixels starting at (x,y)
+ **/
+static void draw_depth_block(int x, int y, simd_int mask,
+                             simd_float reciprocal_w, simd_float u_over_w,
+                             simd_float v_over_w,
+                             triangle_attribs_t *attribs) {
+  (void)u_over_w;
+  (void)v_over_w;
+  (void)attribs;
+  float *depth = get_z_buffer() + (get_window_width() * y) + x;
+  simd_float z = simd_sub_f(simd_set1_f(1.0), reciprocal_w);
+  mask = simd_and_i(mask, simd_cmplt_f(z, simd_load_f(depth)));
+  simd_maskstore_f(depth, mask, z);
+}
+
+/**
+ * Block version of draw_id_pixel: depth test, depth write and triangle id
+ * write for SIMD_WIDTH pixels starting at (x,y)
+ **/
+static void draw_id_block(int x, int y, simd_int mask,
+                          simd_float reciprocal_w, simd_float u_over_w,
+                          simd_float v_over_w, triangle_attribs_t *attribs) {
+  (void)u_over_w;
+  (void)v_over_w;
+  int index = (get_window_width() * y) + x;
+  float *depth = get_z_buffer() + index;
+  simd_float z = simd_sub_f(simd_set1_f(1.0), reciprocal_w);
+  mask = simd_and_i(mask, simd_cmplt_f(z, simd_load_f(depth)));
+  simd_maskstore_f(depth, mask, z);
+  simd_maskstore_i(get_visibility_buffer() + index, mask,
+                   simd_set1_i(attribs->id));
+}
+
+/**
+ * Block version of draw_triangle_pixel: depth test and solid color write for
+ * SIMD_WIDTH pixels starting at (x,y)
+ **/
+static void draw_triangle_block(int x, int y, simd_int mask,
+                                simd_float reciprocal_w, simd_float u_over_w,
+                                simd_float v_over_w,
+                                triangle_attribs_t *attribs) {
+  int index = (get_window_width() * y) + x;
+  float *depth = get_z_buffer() + index;
+  uint32_t *color = get_color_buffer() + index;
+
+  // Flip 1/w so closer pixels have smaller values
+  simd_float z = simd_sub_f(simd_set1_f(1.0), reciprocal_w);
+
+  // Masked depth test against the z-buffer
+  mask = simd_depth_test(mask, z, simd_load_f(depth));
+  if (!simd_movemask(mask)) {
+    return;
+  }
+
+  simd_maskstore_i(color, mask, simd_set1_i(attribs->color));
+  if (depth_test == DEPTH_TEST_LESS) {
+    simd_maskstore_f(depth, mask, z);
+  }
+}
+
+/**
+ * Block version of draw_texel: perspective-correct UVs, depth test and texture
+ * fetch for SIMD_WIDTH pixels starting at (x,y)
+ **/
+static void draw_texel_block(int x, int y, simd_int mask,
+                             simd_float reciprocal_w, simd_float u_over_w,
+                             simd_float v_over_w,
+                             triangle_attribs_t *attribs) {
+  int index = (get_window_width() * y) + x;
+  float *depth = get_z_buffer() + index;
+  uint32_t *color = get_color_buffer() + index;
+  simd_float z = simd_sub_f(simd_set1_f(1.0), reciprocal_w);
+
+  // Masked depth test first so hidden blocks skip the texture fetch
+  mask = simd_depth_test(mask, z, simd_load_f(depth));
+  if (!simd_movemask(mask)) {
+    return;
+  }
+
+  // Divide back by 1/w and fetch the texels
+  simd_float w = simd_div_f(simd_set1_f(1.0), reciprocal_w);
+  simd_float interpolated_u = simd_mul_f(u_over_w, w);
+  simd_float interpolated_v = simd_mul_f(v_over_w, w);
+
+  simd_int texel =
+      simd_sample_texture(attribs, interpolated_u, interpolated_v, mask);
+  simd_maskstore_i(color, mask, texel);
+  if (depth_test == DEPTH_TEST_LESS) {
+    simd_maskstore_f(depth, mask, z);
+  }
+}
+#endif
+
 ///////////////////////////////////////////////////////////////////////////////
 // Function to draw a solid pixel at position (x,y) using depth interpolation
 ///////////////////////////////////////////////////////////////////////////////
-void draw_triangle_pixel(int x, int y, uint32_t color, vec4_t point_a,
-                         vec4_t point_b, vec4_t point_c) {
-  // Create three vec2 to find the interpolation
-  vec2_t p = {x, y};
-  vec2_t a = vec2_from_vec4(point_a);
-  vec2_t b = vec2_from_vec4(point_b);
-  vec2_t c = vec2_from_vec4(point_c);
-
-  // Calculate the barycentric coordinates of our point 'p' inside the triangle
-  vec3_t weights = barycentric_weights(a, b, c, p);
-
-  float alpha = weights.x;
-  float beta = weights.y;
-  float gamma = weights.z;
-
-  // Interpolate the value of 1/w for the current pixel
-  float interpolated_reciprocal_w = (1 / point_a.w) * alpha +
-                                    (1 / point_b.w) * beta +
-                                    (1 / point_c.w) * gamma;
+void draw_triangle_pixel(int x, int y, interpolants_t values,
+                         triangle_attribs_t *attribs) {
+  // The rasterizer already interpolated 1/w for the current pixel
+  float interpolated_reciprocal_w = values.reciprocal_w;
 
   // Adjust 1/w so the pixels that are closer to the camera have smaller values
   interpolated_reciprocal_w = 1.0 - interpolated_reciprocal_w;
 
   // Only draw the pixel if the depth value is less than the one previously
-  // stored in the z-buffer
-  if (interpolated_reciprocal_w < get_zbuffer_at(x, y)) {
+  // stored in the z-buffer (or equal to it, after a depth prepass)
+  if (passes_depth_test(interpolated_reciprocal_w, get_zbuffer_at(x, y))) {
     // Draw a pixel at position (x,y) with a solid color
-    draw_pixel(x, y, color);
+    draw_pixel(x, y, attribs->color);
 
     // Update the z-buffer value with the 1/w of this current pixel
-    set_zbuffer_at(x, y, interpolated_reciprocal_w);
+    if (depth_test == DEPTH_TEST_LESS) {
+      set_zbuffer_at(x, y, interpolated_reciprocal_w);
+    }
   }
 }
 
-void draw_filled_triangle(int x0, int y0, float z0, float w0, int x1, int y1,
-                          float z1, float w1, int x2, int y2, float z2,
-                          float w2, uint32_t color) {
-  // We need to sort the vertices by y-coordinate ascending (y0 < y1 < y2)
-  if (y0 > y1) {
-    int_swap(&y0, &y1);
-    int_swap(&x0, &x1);
-    float_swap(&z0, &z1);
-    float_swap(&w0, &w1);
-  }
-  if (y1 > y2) {
-    int_swap(&y1, &y2);
-    int_swap(&x1, &x2);
-    float_swap(&z1, &z2);
-    float_swap(&w1, &w2);
+/**
+ * Depth-only version of draw_triangle_pixel for the depth prepass: no color,
+ * just the depth test and the z-buffer update
+ **/
+static void draw_depth_pixel(int x, int y, interpolants_t values,
+                             triangle_attribs_t *attribs) {
+  (void)attribs;
+  float z = 1.0 - values.reciprocal_w;
+  if (z < get_zbuffer_at(x, y)) {
+    set_zbuffer_at(x, y, z);
   }
-  if (y0 > y1) {
-    int_swap(&y0, &y1);
-    int_swap(&x0, &x1);
-    float_swap(&z0, &z1);
-    float_swap(&w0, &w1);
+}
+
+void draw_triangle_depth(triangle_position_t *triangle, rect_t scissor) {
+  // Only the 1/w gradient gets set up: no U/w or V/w, texture or color
+  triangle_setup_t setup;
+  if (!setup_triangle(triangle, scissor, &setup)) {
+    return;
   }
 
-  // Create three vector points after we sort the vertices
-  vec4_t point_a = {x0, y0, z0, w0};
-  vec4_t point_b = {x1, y1, z1, w1};
-  vec4_t point_c = {x2, y2, z2, w2};
-
-  ///////////////////////////////////////////////////////
-  // Render the upper part of the triangle (flat-bottom)
-  ///////////////////////////////////////////////////////
-  float inv_slope_1 = 0;
-  float inv_slope_2 = 0;
-
-  if (y1 - y0 != 0)
-    inv_slope_1 = (float)(x1 - x0) / abs(y1 - y0);
-  if (y2 - y0 != 0)
-    inv_slope_2 = (float)(x2 - x0) / abs(y2 - y0);
-
-  if (y1 - y0 != 0) {
-    for (int y = y0; y <= y1; y++) {
-      int x_start = x1 + (y - y1) * inv_slope_1;
-      int x_end = x0 + (y - y0) * inv_slope_2;
-
-      if (x_end < x_start) {
-        int_swap(&x_start, &x_end); // swap if x_start is to the right of x_end
-      }
+  triangle_attribs_t attribs = {0};
 
-      for (int x = x_start; x < x_end; x++) {
-        // Draw our pixel with a solid color
-        draw_triangle_pixel(x, y, color, point_a, point_b, point_c);
-      }
-    }
+#if SIMD_WIDTH > 1
+  rasterize_triangle_blocks(&setup, draw_depth_block, draw_depth_pixel,
+                            &attribs);
+#else
+  rasterize_triangle(&setup, draw_depth_pixel, &attribs);
+#endif
+}
+
+void draw_filled_triangle(triangle_position_t *triangle,
+                          triangle_shading_t *shading, rect_t scissor) {
+  triangle_setup_t setup;
+  if (!setup_triangle(triangle, scissor, &setup)) {
+    return;
   }
+  setup.writes_depth = depth_test == DEPTH_TEST_LESS;
 
-  ///////////////////////////////////////////////////////
-  // Render the bottom part of the triangle (flat-top)
-  ///////////////////////////////////////////////////////
-  inv_slope_1 = 0;
-  inv_slope_2 = 0;
+  // Only 1/w is needed per pixel, and setup_triangle already made its gradient
+  triangle_attribs_t attribs = {.color = shading->color};
 
-  if (y2 - y1 != 0)
-    inv_slope_1 = (float)(x2 - x1) / abs(y2 - y1);
-  if (y2 - y0 != 0)
-    inv_slope_2 = (float)(x2 - x0) / abs(y2 - y0);
+#if SIMD_WIDTH > 1
+  rasterize_triangle_blocks(&setup, draw_triangle_block, draw_triangle_pixel,
+                            &attribs);
+#else
+  rasterize_triangle(&setup, draw_triangle_pixel, &attribs);
+#endif
+}
 
-  if (y2 - y1 != 0) {
-    for (int y = y1; y <= y2; y++) {
-      int x_start = x1 + (y - y1) * inv_slope_1;
-      int x_end = x0 + (y - y0) * inv_slope_2;
+/**
+ * Blend the four 8-bit channels of texels a and b as (a * (256 - f) + b * f)
+ * / 256, f in [0, 255]. Two channels at a time sit in the 16-bit halves of a
+ * word, and no product or sum leaves its half
+ **/
+static uint32_t lerp_texels(uint32_t a, uint32_t b, uint32_t f) {
+  uint32_t rb = (a & 0x00FF00FF) * (256 - f) + (b & 0x00FF00FF) * f;
+  uint32_t ga =
+      ((a >> 8) & 0x00FF00FF) * (256 - f) + ((b >> 8) & 0x00FF00FF) * f;
+  return ((rb >> 8) & 0x00FF00FF) | (ga & 0xFF00FF00);
+}
 
-      if (x_end < x_start) {
-        int_swap(&x_start, &x_end); // swap if x_start is to the right of x_end
-      }
+/**
+ * Texel column x of the sampled mip level, clamped to the cell of the
+ * triangle's texture (so atlas neighbours never bleed in) and then wrapped
+ * around (so unpacked textures repeat)
+ **/
+static int wrap_texel_x(triangle_attribs_t *attribs, int x) {
+  x = x < attribs->cell.min_x ? attribs->cell.min_x : x;
+  x = x > attribs->cell.max_x ? attribs->cell.max_x : x;
+  return x & attribs->texture->width_mask;
+}
 
-      for (int x = x_start; x < x_end; x++) {
-        // Draw our pixel with a solid color
-        draw_triangle_pixel(x, y, color, point_a, point_b, point_c);
-      }
-    }
-  }
+static int wrap_texel_y(triangle_attribs_t *attribs, int y) {
+  y = y < attribs->cell.min_y ? attribs->cell.min_y : y;
+  y = y > attribs->cell.max_y ? attribs->cell.max_y : y;
+  return y & attribs->texture->height_mask;
 }
 
 /**
- * Draw the textured pixel at position x and y using interpolation
+ * Bilinear version of sample_texture: blend the 2x2 texels whose centers
+ * surround (u, v), weighted in 1/256 steps
  **/
-void draw_texel(int x, int y, upng_t *texture, vec4_t point_a, vec4_t point_b,
-                vec4_t point_c, tex2_t a_uv, tex2_t b_uv, tex2_t c_uv) {
-  vec2_t p = {x, y};
-  vec2_t a = vec2_from_vec4(point_a);
-  vec2_t b = vec2_from_vec4(point_b);
-  vec2_t c = vec2_from_vec4(point_c);
+static uint32_t sample_texture_bilinear(triangle_attribs_t *attribs, float u,
+                                        float v) {
+  mip_level_t *texture = attribs->texture;
+
+  // Texel coordinates relative to the texel centers, in 24.8 fixed point
+  // (rounded down, as they are negative before the first texel center)
+  int s = (int)floorf((u * texture->scale_u - 0.5f) * 256.0f);
+  int t = (int)floorf((v * texture->scale_v - 0.5f) * 256.0f);
+  int x0 = wrap_texel_x(attribs, s >> 8);
+  int y0 = wrap_texel_y(attribs, t >> 8);
+  int x1 = wrap_texel_x(attribs, (s >> 8) + 1);
+  int y1 = wrap_texel_y(attribs, (t >> 8) + 1);
+
+  int shift = texture->tile_row_shift;
+  uint32_t texel00 = texture->buffer[texel_address(x0, y0, shift)];
+  uint32_t texel10 = texture->buffer[texel_address(x1, y0, shift)];
+  uint32_t texel01 = texture->buffer[texel_address(x0, y1, shift)];
+  uint32_t texel11 = texture->buffer[texel_address(x1, y1, shift)];
+
+  uint32_t fx = s & 255;
+  uint32_t fy = t & 255;
+  return lerp_texels(lerp_texels(texel00, texel10, fx),
+                     lerp_texels(texel01, texel11, fx), fy);
+}
 
-  vec3_t weights = barycentric_weights(a, b, c, p);
+/**
+ * Fetch the texel at texture coordinates (u, v), repeating the texture
+ * outside [0, 1) (clamping to its cell when it is packed in an atlas)
+ **/
+static uint32_t sample_texture(triangle_attribs_t *attribs, float u, float v) {
+  if (texture_filter == TEXTURE_FILTER_BILINEAR) {
+    return sample_texture_bilinear(attribs, u, v);
+  }
 
-  float alpha = weights.x;
-  float beta = weights.y;
-  float gamma = weights.z;
+  mip_level_t *texture = attribs->texture;
 
-  // Variables to store the interpolated values of U, V, and also 1/w for the
-  // current pixel
-  float interpolated_u;
-  float interpolated_v;
-  float interpolated_reciprocal_w;
+  // Map the UV coordinate to the full texture width and height. The sizes are
+  // powers of two, so masking the texel coordinates repeats the texture (the
+  // coordinates are rounded down, so that negative UVs repeat it seamlessly)
+  int tex_x = wrap_texel_x(attribs, (int)floorf(u * texture->scale_u));
+  int tex_y = wrap_texel_y(attribs, (int)floorf(v * texture->scale_v));
 
-  // Perform the interpolation of all U/w and V/w values using barycentric
-  // weights and a factor of 1/w
-  interpolated_u = (a_uv.u / point_a.w) * alpha + (b_uv.u / point_b.w) * beta +
-                   (c_uv.u / point_c.w) * gamma;
-  interpolated_v = (a_uv.v / point_a.w) * alpha + (b_uv.v / point_b.w) * beta +
-                   (c_uv.v / point_c.w) * gamma;
+  return texture->buffer[texel_address(tex_x, tex_y, texture->tile_row_shift)];
+}
 
-  // Also interpolate the value of 1/w for the current pixel
-  interpolated_reciprocal_w = (1 / point_a.w) * alpha + (1 / point_b.w) * beta +
-                              (1 / point_c.w) * gamma;
+/**
+ * Draw the textured pixel at position x and y using interpolation
+ **/
+void draw_texel(int x, int y, interpolants_t values,
+                triangle_attribs_t *attribs) {
+  // The rasterizer stepped U/w, V/w and 1/w to the current pixel
+  float interpolated_u = values.u_over_w;
+  float interpolated_v = values.v_over_w;
+  float interpolated_reciprocal_w = values.reciprocal_w;
 
   // Now we can divide back both interpolated values by 1/w
-  interpolated_u /= interpolated_reciprocal_w;
-  interpolated_v /= interpolated_reciprocal_w;
-
-  // get texture dimenions
-  int texture_width = upng_get_width(texture);
-  int texture_height = upng_get_height(texture);
-  ;
-
-  // Map the UV coordinate to the full texture width and height
-  // Truncating within the allocated dimensions at the end of these lines is a
-  // messy hack to make sure we are not trying to write to a value outside of
-  // allocated memory GPU's take care of this using Fill Convention. We are
-  // doing it the old fashioned way Note that this may result in some 'tears'
-  // between faces
-  int tex_x = abs((int)(interpolated_u * texture_width)) % texture_width;
-  int tex_y = abs((int)(interpolated_v * texture_height)) % texture_height;
+  float interpolated_w = 1 / interpolated_reciprocal_w;
+  interpolated_u *= interpolated_w;
+  interpolated_v *= interpolated_w;
 
   // invert 1/w so pixels that are closer to cam have smaller values
   interpolated_reciprocal_w = 1.0 - interpolated_reciprocal_w;
 
   // As long as the current pixel is in front of what is there currently
   // (i.e., depth value of this pixel is LESS than the one previously stored in
-  // z-buffer)...
-  if (interpolated_reciprocal_w < get_zbuffer_at(x, y)) {
-    // get buffer of colors from the texture
-    uint32_t *texture_buffer = (uint32_t *)upng_get_buffer(texture);
+  // z-buffer, or EQUAL to it after a depth prepass)...
+  if (passes_depth_test(interpolated_reciprocal_w, get_zbuffer_at(x, y))) {
     // ...draw the pixel
-    draw_pixel(x, y, texture_buffer[(texture_width * tex_y) + tex_x]);
+    draw_pixel(x, y, sample_texture(attribs, interpolated_u, interpolated_v));
     // ... and update the z-buffer value with the 1/w (1 / old z in camera
     // space) of this current pixel
-    set_zbuffer_at(x, y, interpolated_reciprocal_w);
+    if (depth_test == DEPTH_TEST_LESS) {
+      set_zbuffer_at(x, y, interpolated_reciprocal_w);
+    }
   }
 }
 
@@ -276,100 +914,242 @@ texture_height); draw_pixel(x, y, texture[texIndex]);
 }
 */
 
-void draw_textured_triangle(int x0, int y0, float z0, float w0, float u0,
-                            float v0, int x1, int y1, float z1, float w1,
-                            float u1, float v1, int x2, int y2, float z2,
-                            float w2, float u2, float v2, upng_t *texture) {
-  // We need to sort the vertices by y-coordinate ascending (y0 < y1 < y2)
-  if (y0 > y1) {
-    int_swap(&y0, &y1);
-    int_swap(&x0, &x1);
-    float_swap(&z0, &z1);
-    float_swap(&w0, &w1);
-    float_swap(&u0, &u1);
-    float_swap(&v0, &v1);
+/**
+ * Pick the mip level of texture for a triangle from the screen space
+ * derivatives of its texel coordinates, taken at the centroid of the triangle.
+ * A pixel step covering 2^n texels selects level n (rounded to the nearest
+ * level), so no pixel skips over texels the level still resolves
+ **/
+static int select_mip_level(texture_t *texture, triangle_position_t *triangle,
+                            triangle_shading_t *shading,
+                            gradient_t *reciprocal_w, gradient_t *u_over_w,
+                            gradient_t *v_over_w) {
+  if (!mipmapping || texture->num_levels == 1) {
+    return 0;
   }
-  if (y1 > y2) {
-    int_swap(&y1, &y2);
-    int_swap(&x1, &x2);
-    float_swap(&z1, &z2);
-    float_swap(&w1, &w2);
-    float_swap(&u1, &u2);
-    float_swap(&v1, &v2);
+
+  // u = (u/w) / (1/w), so du/dx = (d(u/w)/dx - u * d(1/w)/dx) / (1/w)
+  vec3_t q = triangle->reciprocal_w;
+  float centroid_q = (q.x + q.y + q.z) / 3;
+  vec3_t uq = shading->u_over_w;
+  vec3_t vq = shading->v_over_w;
+  float u = (uq.x + uq.y + uq.z) / 3 / centroid_q;
+  float v = (vq.x + vq.y + vq.z) / 3 / centroid_q;
+  float texels_x = texture->levels[0].scale_u / centroid_q;
+  float texels_y = texture->levels[0].scale_v / centroid_q;
+
+  float du_dx = (u_over_w->step_x - u * reciprocal_w->step_x) * texels_x;
+  float dv_dx = (v_over_w->step_x - v * reciprocal_w->step_x) * texels_y;
+  float du_dy = (u_over_w->step_y - u * reciprocal_w->step_y) * texels_x;
+  float dv_dy = (v_over_w->step_y - v * reciprocal_w->step_y) * texels_y;
+  float rho_x = du_dx * du_dx + dv_dx * dv_dx;
+  float rho_y = du_dy * du_dy + dv_dy * dv_dy;
+  float rho = rho_x > rho_y ? rho_x : rho_y;
+
+  // rho is the squared number of texels per pixel step; this also catches NaN
+  if (!(rho > 1.0f)) {
+    return 0;
   }
-  if (y0 > y1) {
-    int_swap(&y0, &y1);
-    int_swap(&x0, &x1);
-    float_swap(&z0, &z1);
-    float_swap(&w0, &w1);
-    float_swap(&u0, &u1);
-    float_swap(&v0, &v1);
+  int level = (int)(0.5f * log2f(rho) + 0.5f);
+  if (level >= texture->num_levels) {
+    level = texture->num_levels - 1;
   }
+  return level;
+}
 
-  // Flip the V component to account for inverted UV-coordinates (V grows
-  // downwards)
-  v0 = 1.0 - v0;
-  v1 = 1.0 - v1;
-  v2 = 1.0 - v2;
-
-  // Create vector points and texture coords after we sort the vertices
-  vec4_t point_a = {x0, y0, z0, w0};
-  vec4_t point_b = {x1, y1, z1, w1};
-  vec4_t point_c = {x2, y2, z2, w2};
-  tex2_t a_uv = {u0, v0};
-  tex2_t b_uv = {u1, v1};
-  tex2_t c_uv = {u2, v2};
-
-  ///////////////////////////////////////////////////////
-  // Render the upper part of the triangle (flat-bottom)
-  ///////////////////////////////////////////////////////
-  float inv_slope_1 = 0;
-  float inv_slope_2 = 0;
-
-  if (y1 - y0 != 0)
-    inv_slope_1 = (float)(x1 - x0) / abs(y1 - y0);
-  if (y2 - y0 != 0)
-    inv_slope_2 = (float)(x2 - x0) / abs(y2 - y0);
-
-  if (y1 - y0 != 0) {
-    for (int y = y0; y <= y1; y++) {
-      int x_start = x1 + (y - y1) * inv_slope_1;
-      int x_end = x0 + (y - y0) * inv_slope_2;
-
-      if (x_end < x_start) {
-        int_swap(&x_start, &x_end); // swap if x_start is to the right of x_end
-      }
+/**
+ * Point attribs at the mip level of texture the triangle samples, and at the
+ * texture's cell in it
+ **/
+static void set_texture_attribs(triangle_attribs_t *attribs,
+                                triangle_position_t *triangle,
+                                triangle_shading_t *shading,
+                                gradient_t *reciprocal_w,
+                                gradient_t *u_over_w, gradient_t *v_over_w) {
+  texture_t *texture = get_texture(shading->texture);
+  int level = select_mip_level(texture, triangle, shading, reciprocal_w,
+                               u_over_w, v_over_w);
+  attribs->texture = &texture->levels[level];
+  attribs->cell = texture->cells[level];
+}
 
-      for (int x = x_start; x < x_end; x++) {
-        // Draw our pixel with the color that comes from the texture
-        draw_texel(x, y, texture, point_a, point_b, point_c, a_uv, b_uv, c_uv);
-      }
-    }
+void draw_textured_triangle(triangle_position_t *triangle,
+                            triangle_shading_t *shading, rect_t scissor) {
+  // The depth prepass and the visibility buffer see every triangle, so one
+  // without a texture still covers what lies behind it
+  if (shading->texture < 0) {
+    draw_filled_triangle(triangle, shading, scissor);
+    return;
+  }
+  triangle_setup_t setup;
+  if (!setup_triangle(triangle, scissor, &setup)) {
+    return;
   }
+  setup.writes_depth = depth_test == DEPTH_TEST_LESS;
+
+  // U/w and V/w are linear in screen space, and the geometry stage already
+  // divided each vertex attribute by w, so the rasterizer steps them just like
+  // 1/w
+  setup.u_over_w = make_gradient(triangle, shading->u_over_w);
+  setup.v_over_w = make_gradient(triangle, shading->v_over_w);
+
+  triangle_attribs_t attribs = {0};
+  set_texture_attribs(&attribs, triangle, shading, &setup.reciprocal_w,
+                      &setup.u_over_w, &setup.v_over_w);
+
+#if SIMD_WIDTH > 1
+  rasterize_triangle_blocks(&setup, draw_texel_block, draw_texel, &attribs);
+#else
+  rasterize_triangle(&setup, draw_texel, &attribs);
+#endif
+}
 
-  ///////////////////////////////////////////////////////
-  // Render the bottom part of the triangle (flat-top)
-  ///////////////////////////////////////////////////////
-  inv_slope_1 = 0;
-  inv_slope_2 = 0;
+///////////////////////////////////////////////////////////////////////////////
+// Visibility buffer (deferred texturing)
+///////////////////////////////////////////////////////////////////////////////
+// RENDER_VISIBILITY first rasterizes nothing but depth and the render queue
+// index of every triangle into the visibility buffer. A resolve pass then
+// shades each covered pixel exactly once: it rebuilds the screen space
+// gradients of U/w, V/w and 1/w of the pixel's triangle, evaluates them at the
+// pixel center and samples the texture. Shading cost no longer depends on
+// overdraw or on the number of triangles, only on the number of pixels
+///////////////////////////////////////////////////////////////////////////////
 
-  if (y2 - y1 != 0)
-    inv_slope_1 = (float)(x2 - x1) / abs(y2 - y1);
-  if (y2 - y0 != 0)
-    inv_slope_2 = (float)(x2 - x0) / abs(y2 - y0);
+/**
+ * Depth test and write, plus triangle id write, for the pixel at (x,y)
+ **/
+static void draw_id_pixel(int x, int y, interpolants_t values,
+                          triangle_attribs_t *attribs) {
+  float z = 1.0 - values.reciprocal_w;
+  if (z < get_zbuffer_at(x, y)) {
+    set_zbuffer_at(x, y, z);
+    get_visibility_buffer()[(get_window_width() * y) + x] = attribs->id;
+  }
+}
+
+void draw_triangle_id(triangle_position_t *triangle, uint32_t id,
+                      rect_t scissor) {
+  triangle_setup_t setup;
+  if (!setup_triangle(triangle, scissor, &setup)) {
+    return;
+  }
+
+  triangle_attribs_t attribs = {.id = id};
+
+#if SIMD_WIDTH > 1
+  rasterize_triangle_blocks(&setup, draw_id_block, draw_id_pixel, &attribs);
+#else
+  rasterize_triangle(&setup, draw_id_pixel, &attribs);
+#endif
+}
 
-  if (y2 - y1 != 0) {
-    for (int y = y1; y <= y2; y++) {
-      int x_start = x1 + (y - y1) * inv_slope_1;
-      int x_end = x0 + (y - y0) * inv_slope_2;
+// Everything the resolve pass needs about the triangle of a pixel
+typedef struct {
+  uint32_t id; // render queue index of the triangle set up below
+  gradient_t reciprocal_w;
+  gradient_t u_over_w;
+  gradient_t v_over_w;
+  triangle_attribs_t attribs; // texture (NULL for none) and color
+} resolve_setup_t;
+
+/**
+ * Set up triangle id for resolving, unless it is the one set up last time
+ * (neighbouring pixels mostly belong to the same triangle)
+ **/
+static resolve_setup_t *get_resolve_setup(resolve_setup_t *setup,
+                                          triangle_position_t *triangles,
+                                          triangle_shading_t *shadings,
+                                          uint32_t id) {
+  if (setup->id != id) {
+    triangle_position_t *triangle = &triangles[id];
+    triangle_shading_t *shading = &shadings[id];
+    setup->id = id;
+    setup->reciprocal_w = make_gradient(triangle, triangle->reciprocal_w);
+    setup->attribs.color = shading->color;
+    setup->attribs.texture = NULL;
+    if (shading->texture >= 0) {
+      setup->u_over_w = make_gradient(triangle, shading->u_over_w);
+      setup->v_over_w = make_gradient(triangle, shading->v_over_w);
+      set_texture_attribs(&setup->attribs, triangle, shading,
+                          &setup->reciprocal_w, &setup->u_over_w,
+                          &setup->v_over_w);
+    }
+  }
+  return setup;
+}
 
-      if (x_end < x_start) {
-        int_swap(&x_start, &x_end); // swap if x_start is to the right of x_end
+/**
+ * Texture the pixel at (x,y) with the triangle set up in setup, or give it
+ * the flat color of an untextured triangle
+ **/
+static uint32_t resolve_pixel(resolve_setup_t *setup, int x, int y) {
+  if (setup->attribs.texture == NULL) {
+    return setup->attribs.color;
+  }
+  float reciprocal_w = evaluate_gradient(&setup->reciprocal_w, x, y);
+  float w = 1 / reciprocal_w;
+  float u = evaluate_gradient(&setup->u_over_w, x, y) * w;
+  float v = evaluate_gradient(&setup->v_over_w, x, y) * w;
+  return sample_texture(&setup->attribs, u, v);
+}
+
+#if SIMD_WIDTH > 1
+/**
+ * Block version of resolve_pixel for SIMD_WIDTH pixels starting at (x,y), all
+ * covered by the triangle set up in setup
+ **/
+static void resolve_block(resolve_setup_t *setup, int x, int y,
+                          uint32_t *color) {
+  if (setup->attribs.texture == NULL) {
+    simd_store_i(color, simd_set1_i(setup->attribs.color));
+    return;
+  }
+  simd_float reciprocal_w = simd_evaluate_gradient(&setup->reciprocal_w, x, y);
+  simd_float w = simd_div_f(simd_set1_f(1.0), reciprocal_w);
+  simd_float u =
+      simd_mul_f(simd_evaluate_gradient(&setup->u_over_w, x, y), w);
+  simd_float v =
+      simd_mul_f(simd_evaluate_gradient(&setup->v_over_w, x, y), w);
+  simd_store_i(color,
+               simd_sample_texture(&setup->attribs, u, v, simd_set1_i(-1)));
+}
+#endif
+
+void resolve_visibility(triangle_position_t *triangles,
+                        triangle_shading_t *shadings, rect_t rect) {
+  int window_width = get_window_width();
+  resolve_setup_t setup = {.id = NO_TRIANGLE};
+
+  for (int y = rect.min_y; y <= rect.max_y; y++) {
+    uint32_t *ids = get_visibility_buffer() + (window_width * y);
+    uint32_t *colors = get_color_buffer() + (window_width * y);
+    int x = rect.min_x;
+
+#if SIMD_WIDTH > 1
+    // Blocks covered by a single triangle are shaded all at once, the others
+    // pixel by pixel
+    for (; x + SIMD_WIDTH - 1 <= rect.max_x; x += SIMD_WIDTH) {
+      uint32_t id = ids[x];
+      simd_int same_id = simd_cmpeq_i(simd_load_i(ids + x), simd_set1_i(id));
+      if (id != NO_TRIANGLE &&
+          simd_movemask(same_id) == (1 << SIMD_WIDTH) - 1) {
+        resolve_block(get_resolve_setup(&setup, triangles, shadings, id), x,
+                      y, colors + x);
+        continue;
       }
+      for (int i = x; i < x + SIMD_WIDTH; i++) {
+        if (ids[i] != NO_TRIANGLE) {
+          colors[i] = resolve_pixel(
+              get_resolve_setup(&setup, triangles, shadings, ids[i]), i, y);
+        }
+      }
+    }
+#endif
 
-      for (int x = x_start; x < x_end; x++) {
-        // Draw our pixel with the color that comes from the texture
-        draw_texel(x, y, texture, point_a, point_b, point_c, a_uv, b_uv, c_uv);
+    for (; x <= rect.max_x; x++) {
+      if (ids[x] != NO_TRIANGLE) {
+        colors[x] = resolve_pixel(
+            get_resolve_setup(&setup, triangles, shadings, ids[x]), x, y);
       }
     }
   }
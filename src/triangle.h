@@ -1,9 +1,11 @@
 #ifndef TRIANGLE_H
 #define TRIANGLE_H
 
+#include "display.h"
 #include "texture.h"
 #include "upng.h"
 #include "vector.h"
+#include <math.h>
 #include <stdint.h>
 
 // face_t stores indices of vertices (corner 1, 2, 3)
@@ -26,13 +28,91 @@ typedef struct {
   upng_t *texture;
 } triangle_t;
 
+// Screen coordinates of the render queue are fixed point with SUBPIXEL_BITS
+// fractional bits (28.4), snapped once by the geometry stage so the rasterizer
+// can work with exact integer edge functions
+#define SUBPIXEL_BITS 4
+#define SUBPIXEL_SCALE (1 << SUBPIXEL_BITS)
+// Largest distance (in pixels) from the screen origin a vertex can have for
+// the rasterizer's 32-bit edge functions not to overflow
+#define MAX_SCREEN_COORD 4096
+
+// The render queue holds every triangle as two records at the same index in
+// two separate arrays. The passes that only need to know where a triangle
+// lands (like tile binning) read the positions alone, and never pull the
+// shading attributes through the cache.
+//
+// triangle_position_t (36 bytes): subpixel screen coordinates and 1/w
+typedef struct {
+  int32_t x[3];        // subpixel screen coordinates of vertex a, b and c
+  int32_t y[3];
+  vec3_t reciprocal_w; // 1/w of vertex a, b and c
+} triangle_position_t;
+
+// triangle_shading_t (32 bytes): the per-vertex attributes already divided by
+// w, the flat color and a texture handle
+typedef struct {
+  vec3_t u_over_w; // u/w of vertex a, b and c
+  vec3_t v_over_w; // v/w of vertex a, b and c, v flipped to grow downwards
+  uint32_t color;  // lit flat color
+  int16_t texture; // texture handle (see add_texture), -1 for none
+} triangle_shading_t;
+
+// Snap a screen coordinate in pixels to the subpixel grid (round to nearest)
+static inline int32_t snap_to_subpixel(float coord) {
+  return (int32_t)floorf(coord * SUBPIXEL_SCALE + 0.5f);
+}
+
+// Whole pixel containing a subpixel screen coordinate
+static inline int subpixel_to_pixel(int32_t coord) {
+  return coord >> SUBPIXEL_BITS;
+}
+
+// interpolants_t holds the values the rasterizer interpolates at one pixel.
+// They are linear in screen space, so it steps them from pixel to pixel with
+// additions and the pixel functions stay division free (apart from recovering
+// u and v from u/w and v/w)
+typedef struct {
+  float reciprocal_w;
+  float u_over_w;
+  float v_over_w;
+} interpolants_t;
+
+// triangle_attribs_t holds the per-triangle values of the pixel functions
+typedef struct {
+  uint32_t color;
+  mip_level_t *texture; // mip level sampled by the textured pixel functions
+  texel_rect_t cell;    // texels of it the samples are clamped to
+  uint32_t id;          // render queue index (visibility buffer)
+} triangle_attribs_t;
+
+// Depth test of the filled and textured drawing functions: LESS draws the
+// pixels in front of the z-buffer and updates it, EQUAL draws only the pixels
+// a depth prepass (draw_triangle_depth) found visible and leaves it alone
+enum depth_test { DEPTH_TEST_LESS, DEPTH_TEST_EQUAL };
+void set_depth_test(int depth_test);
+
+// Texture sampling: NEAREST fetches the texel under the pixel center,
+// BILINEAR blends the four texels around it
+enum texture_filter { TEXTURE_FILTER_NEAREST, TEXTURE_FILTER_BILINEAR };
+void set_texture_filter(int filter);
+
+// Texture sampling picks a mip level per triangle from its UV derivatives;
+// switched off it always samples the full size texture
+void set_mipmapping(bool enabled);
+
+// The triangle drawing functions only touch pixels inside scissor, so the
+// screen can be split into rectangles that are drawn independently
 void draw_triangle(int x0, int y0, int x1, int y1, int x2, int y2,
-                   uint32_t color);
-void draw_filled_triangle(int x0, int y0, float z0, float w0, int x1, int y1,
-                          float z1, float w1, int x2, int y2, float z2,
-                          float w2, uint32_t color);
-void draw_texel(int x, int y, upng_t *texture, vec4_t point_a, vec4_t point_b,
-                vec4_t point_c, tex2_t a_uv, tex2_t b_uv, tex2_t c_uv);
+                   uint32_t color, rect_t scissor);
+void draw_filled_triangle(triangle_position_t *triangle,
+                          triangle_shading_t *shading, rect_t scissor);
+// Depth-only rasterizer: z-buffer test and update, nothing else
+void draw_triangle_depth(triangle_position_t *triangle, rect_t scissor);
+void draw_triangle_pixel(int x, int y, interpolants_t values,
+                         triangle_attribs_t *attribs);
+void draw_texel(int x, int y, interpolants_t values,
+                triangle_attribs_t *attribs);
 // AFFINE MAPPING (draw_texel):
 /*
 void draw_texel(
@@ -51,9 +131,15 @@ void draw_textured_triangle(
 );
 */
 
-void draw_textured_triangle(int x0, int y0, float z0, float w0, float u0,
-                            float v0, int x1, int y1, float z1, float w1,
-                            float u1, float v1, int x2, int y2, float z2,
-                            float w2, float u2, float v2, upng_t *texture);
+void draw_textured_triangle(triangle_position_t *triangle,
+                            triangle_shading_t *shading, rect_t scissor);
+
+// Visibility buffer rendering: draw_triangle_id only writes depth and the
+// render queue index id of the triangle, resolve_visibility then textures the
+// pixels of rect from the visibility buffer, each one exactly once
+void draw_triangle_id(triangle_position_t *triangle, uint32_t id,
+                      rect_t scissor);
+void resolve_visibility(triangle_position_t *triangles,
+                        triangle_shading_t *shadings, rect_t rect);
 
 #endif
@@ -72,6 +72,11 @@ vec3_t vec3_clone(vec3_t *v) {
   return result;
 }
 
+/**
+ * Get the length (magnitude) of a 3D vector
+ */
+float vec3_length(vec3_t v) { return sqrt(v.x * v.x + v.y * v.y + v.z * v.z); }
+
 /**
  * Get the sum of two 3D vectors
  */